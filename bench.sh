@@ -0,0 +1,80 @@
+#!/bin/bash
+#
+# Run a fixed matrix of echo scenarios over loopback and print the results
+# as a JSON array. Each scenario starts its own eserv and runs ebench
+# against it.
+#
+# Environment variables:
+#	PORT		first port to use (default 9900)
+#	DURATION	seconds per scenario (default 3)
+#	PROTOS		protocols to run (default "stream datagram")
+#	SIZES		message sizes in bytes (default "64 1024 8192")
+#	FLOWS		concurrent flows (default "1 4 16")
+#	DEPTH		messages in flight per flow (default 1)
+#	SERV_OPTS	extra options to eserv
+#	BENCH_OPTS	extra options to ebench
+
+PORT=${PORT:-9900}
+DURATION=${DURATION:-3}
+PROTOS=${PROTOS:-"stream datagram"}
+SIZES=${SIZES:-"64 1024 8192"}
+FLOWS=${FLOWS:-"1 4 16"}
+DEPTH=${DEPTH:-1}
+
+# Prefix of the commands, so another harness can run the server and
+# the client somewhere else, for example, in a network namespace.
+SERV_PREFIX=${SERV_PREFIX:-}
+CLI_PREFIX=${CLI_PREFIX:-}
+SERV_ADDR=${SERV_ADDR:-127.0.0.1}
+
+cd "$(dirname "$0")"
+for prog in eserv ebench
+do
+	if [ ! -x ./$prog ]
+	then
+		echo "$prog is not built, run make first" >&2
+		exit 1
+	fi
+done
+
+SERV_PID=
+stop_server() {
+	if [ -n "$SERV_PID" ]
+	then
+		kill -INT $SERV_PID 2> /dev/null
+		wait $SERV_PID 2> /dev/null
+		SERV_PID=
+	fi
+}
+trap stop_server EXIT
+
+echo "["
+echo "  {\"kernel\": \"$(uname -r)\", \"date\": \"$(date -u +%FT%TZ)\"," \
+	"\"revision\": \"$(git rev-parse --short HEAD 2> /dev/null)\"}"
+for proto in $PROTOS
+do
+	for size in $SIZES
+	do
+		for flows in $FLOWS
+		do
+			PORT=$((PORT + 1))
+			$SERV_PREFIX ./eserv $SERV_OPTS $proto ip $PORT \
+				> /dev/null 2> /dev/null &
+			SERV_PID=$!
+			sleep 0.2
+			echo -n "  ,"
+			# Only a run that succeeded prints JSON, a failed
+			# one may print its usage.
+			if out=$($CLI_PREFIX ./ebench $BENCH_OPTS -c $flows \
+				-s $size -d $DURATION -D $DEPTH $proto ip \
+				$SERV_ADDR $PORT)
+			then
+				echo "$out"
+			else
+				echo "{}"
+			fi
+			stop_server
+		done
+	done
+done
+echo "]"
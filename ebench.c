@@ -0,0 +1,809 @@
+/*
+ * ebench.c
+ *
+ * This program implements a load-generating echo client for benchmarks.
+ * It runs a number of concurrent flows against eserv for a fixed duration,
+ * and prints the throughput and latency of the run as a JSON object.
+ *
+ * With -L, it instead searches, for each of a list of Ethernet frame
+ * sizes, the highest rate that eserv echoes with little enough loss, as in the
+ * throughput test of RFC 2544. Each step of the search is a trial at a
+ * fixed offered rate, and the result is a table of rate versus size.
+ *
+ */
+
+#define _GNU_SOURCE	/* RUSAGE_THREAD */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "eutils.h"
+#include "ehist.h"
+#include "eframe.h"
+#include "eperf.h"
+#include "epool.h"
+
+/* How long a datagram flow waits for an echo before it counts all
+ * datagrams in flight as lost.
+ */
+#define DGRAM_TIMEOUT_MS 200
+
+/* Message size and depth of the bulk flows, see -b. */
+#define BULK_SIZE	(64 * 1024)
+#define BULK_DEPTH	4
+
+/* How often a flow of -m source asks the datagram source to go on, well
+ * within the time eserv keeps sending without a request.
+ */
+#define SOURCE_REFRESH_MS 250
+
+/* Frame sizes that -L searches by default, those of RFC 2544 for
+ * Ethernet. A datagram of the payload of a frame of 1518 bytes fills an
+ * MTU of 1500 bytes, so none of them fragments.
+ */
+#define SEARCH_SIZES	"64,128,256,512,1024,1280,1518"
+
+/* Bytes of an Ethernet frame around a UDP payload: Ethernet header and
+ * FCS, and the IPv4 and UDP headers.
+ */
+#define FRAME_OVERHEAD	(14 + 4 + 20 + 8)
+
+/* How long the search of -L lets the path drain between trials, as
+ * RFC 2544 does, so the backlog of a trial does not load the next.
+ */
+#define SEARCH_SETTLE_MS 2000
+
+/* The search of -L stops once the rates that passed and failed are
+ * within this fraction of each other, or after this many trials.
+ */
+#define SEARCH_RESOLUTION 0.01
+#define SEARCH_TRIALS	20
+
+/* Datagrams a paced flow sends at most at once to catch up. */
+#define PACED_BURST	32
+
+static int is_xia, is_stream;
+static struct sockaddr *cli, *srv;
+static int cli_len, srv_len;
+
+static int concurrency = 1;
+static int bulk_flows;
+static int msg_size = 64;
+static int depth = 1;
+static double duration = 5.0;
+static enum echo_mode mode = MODE_ECHO;
+/* Size of the responses of -m rpc, 0 until set. */
+static int resp_size;
+/* The search of -L, see search_sizes(). */
+static int search;
+static double max_loss_pct;
+static char *sizes = SEARCH_SIZES;
+/* Offered datagrams per second of each flow of a trial, 0 for as fast
+ * as the socket takes them.
+ */
+static double flow_rate;
+
+struct flow {
+	pthread_t		thread;
+	unsigned long		deadline;
+	struct hist		latency;
+	struct pipeline_result	res;
+	unsigned long		lost;
+	int			failed;
+	struct perf_values	perf;
+	int			bulk;
+
+	/* One-way modes count what they send in @res, and what they
+	 * receive in @rx, see send_flow() and recv_flow().
+	 */
+	struct pipeline_result	rx;
+	int			sock;
+	/* CPU seconds of each direction. */
+	double			tx_cpu;
+	double			rx_cpu;
+};
+
+/* CPU time of the calling thread in seconds. */
+static double thread_cpu_seconds(void)
+{
+	struct rusage ru;
+
+	assert(!getrusage(RUSAGE_THREAD, &ru));
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int flow_socket(void)
+{
+	int s = any_socket(is_xia, is_stream);
+
+	assert(s >= 0);
+	any_bind(is_xia, 0, s, cli, cli_len);
+	if (is_stream)
+		assert(!connect(s, srv, srv_len));
+	return s;
+}
+
+static void stream_flow(struct flow *f, int s)
+{
+	f->failed = f->bulk
+		? stream_pipeline(s, ~0UL, BULK_SIZE, 0, BULK_DEPTH,
+			f->deadline, &f->latency, &f->res)
+		: stream_pipeline(s, ~0UL, msg_size,
+			mode == MODE_RPC ? resp_size : 0, depth, f->deadline,
+			&f->latency, &f->res);
+}
+
+/**
+ * datagram_flow(): Keep up to @depth datagrams in flight until the
+ * deadline. Each datagram starts with a frame header, so its echo, or
+ * its response with -m rpc, can be matched to its send time.
+ */
+static void datagram_flow(struct flow *f, int s)
+{
+	int in_size = mode == MODE_RPC ? resp_size : msg_size;
+	char *out = pool_get(msg_size), *in = pool_get(in_size);
+	struct frame_hdr *hdr = (struct frame_hdr *)out;
+	const struct frame_hdr *echo = (const struct frame_hdr *)in;
+	unsigned long in_flight = 0, start = now_ns();
+	/* Echoes of ids before @floor were already counted as lost. */
+	uint32_t id = 0, floor = 0, echo_id;
+
+	memset(out, 'd', msg_size);
+	if (mode == MODE_RPC)
+		((struct rpc_hdr *)out)->resp_len = htobe32(resp_size);
+	while (1) {
+		struct pollfd pfd = {.fd = s, .events = POLLIN};
+		int rc;
+
+		while (in_flight < (unsigned long)depth &&
+			now_ns() < f->deadline) {
+			hdr->len = htobe32(msg_size);
+			hdr->id = htobe32(id++);
+			hdr->ts = htobe64(now_ns());
+			send_packet(s, out, msg_size, srv, srv_len);
+			f->res.sent++;
+			in_flight++;
+		}
+		if (!in_flight)
+			break;
+
+		rc = busy_poll_wait(&pfd, DGRAM_TIMEOUT_MS);
+		assert(rc >= 0);
+		if (!rc) {
+			f->lost += in_flight;
+			in_flight = 0;
+			floor = id;
+			continue;
+		}
+
+		rc = recv(s, in, in_size, 0);
+		assert(rc >= 0);
+		if (rc < (int)sizeof(*echo))
+			continue;
+		echo_id = be32toh(echo->id);
+		/* Late, or not one of ours. */
+		if ((int32_t)(echo_id - floor) < 0 ||
+			(int32_t)(echo_id - id) >= 0)
+			continue;
+		hist_add(&f->latency, now_ns() - be64toh(echo->ts));
+		f->res.received++;
+		f->res.bytes += rc;
+		in_flight--;
+	}
+	f->res.elapsed_ns = now_ns() - start;
+	pool_put(in);
+	pool_put(out);
+}
+
+/**
+ * send_flow(): Send messages as fast as the socket takes them until the
+ * deadline, for eserv -m discard and bidir. Datagrams that the network
+ * drops still count, only eserv knows how many arrived.
+ */
+static void send_flow(struct flow *f, int s)
+{
+	char *out = pool_get(msg_size);
+	unsigned long start = now_ns();
+	double cpu = thread_cpu_seconds();
+
+	memset(out, 'd', msg_size);
+	while (now_ns() < f->deadline) {
+		ssize_t rc = is_stream
+			? send(s, out, msg_size, MSG_NOSIGNAL)
+			: sendto(s, out, msg_size, 0, srv, srv_len);
+
+		if (rc < 0) {
+			if (errno == ENOBUFS)
+				continue;
+			assert(errno == ECONNRESET || errno == EPIPE);
+			f->failed = 1;
+			break;
+		}
+		f->res.sent++;
+		f->res.bytes += rc;
+	}
+	f->res.elapsed_ns = now_ns() - start;
+	f->tx_cpu = thread_cpu_seconds() - cpu;
+	pool_put(out);
+}
+
+/**
+ * recv_flow(): Receive what eserv -m source or bidir sends until the
+ * deadline. A datagram flow asks for datagrams of the message size, and
+ * stops them at the end.
+ */
+static void recv_flow(struct flow *f, int s)
+{
+	int size = is_stream ? POOL_MAX_SIZE : msg_size;
+	char *in = pool_get(size);
+	unsigned long start = now_ns(), refresh = start;
+	double cpu = thread_cpu_seconds();
+
+	memset(in, 'd', size);
+	while (1) {
+		struct pollfd pfd = {.fd = s, .events = POLLIN};
+		unsigned long now = now_ns();
+		ssize_t rc;
+
+		if (now >= f->deadline)
+			break;
+		if (!is_stream && now >= refresh) {
+			send_packet(s, in, msg_size, srv, srv_len);
+			refresh = now + SOURCE_REFRESH_MS * 1000000UL;
+		}
+
+		rc = busy_poll_wait(&pfd, SOURCE_REFRESH_MS);
+		assert(rc >= 0);
+		if (!rc)
+			continue;
+		rc = recv(s, in, size, MSG_DONTWAIT);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			assert(errno == ECONNRESET);
+			rc = 0;
+		}
+		if (!rc && is_stream) {
+			f->failed = 1;
+			break;
+		}
+		f->rx.received++;
+		f->rx.bytes += rc;
+	}
+	f->rx.elapsed_ns = now_ns() - start;
+	f->rx_cpu = thread_cpu_seconds() - cpu;
+	if (!is_stream)
+		send_packet(s, in, 0, srv, srv_len);
+	pool_put(in);
+}
+
+static void *recv_main(void *arg)
+{
+	struct flow *f = arg;
+
+	if (eopts.huge)
+		pool_prefill(POOL_MAX_SIZE);
+	recv_flow(f, f->sock);
+	return NULL;
+}
+
+/**
+ * bidir_flow(): Send and receive at once on the same connection, each
+ * direction in its own thread, so neither waits for the other.
+ */
+static void bidir_flow(struct flow *f, int s)
+{
+	pthread_t rx;
+
+	f->sock = s;
+	assert(!pthread_create(&rx, NULL, recv_main, f));
+	send_flow(f, s);
+	assert(!pthread_join(rx, NULL));
+}
+
+/**
+ * paced_flow(): Send datagrams at @flow_rate until the deadline, and
+ * count the echoes in @f->res. Unlike datagram_flow(), sending never
+ * waits for echoes, so the offered rate does not depend on how fast the
+ * server is. Echoes still in flight at the deadline have
+ * DGRAM_TIMEOUT_MS to arrive, those that do not count as lost.
+ */
+static void paced_flow(struct flow *f, int s)
+{
+	char *out = pool_get(msg_size), *in = pool_get(msg_size);
+	struct frame_hdr *hdr = (struct frame_hdr *)out;
+	unsigned long start = now_ns(), now, due, next;
+	uint32_t id = 0;
+
+	memset(out, 'd', msg_size);
+	hdr->len = htobe32(msg_size);
+	while ((now = now_ns()) < f->deadline) {
+		struct pollfd pfd = {.fd = s, .events = POLLIN};
+		struct timespec ts;
+		int busy = 0;
+		ssize_t rc;
+
+		due = flow_rate ? (now - start) * flow_rate / 1e9 + 1 :
+			f->res.sent + PACED_BURST;
+		if (due > f->res.sent + PACED_BURST)
+			due = f->res.sent + PACED_BURST;
+		while (f->res.sent < due) {
+			hdr->id = htobe32(id++);
+			hdr->ts = htobe64(now_ns());
+			rc = sendto(s, out, msg_size, MSG_DONTWAIT, srv,
+				srv_len);
+			if (rc < 0) {
+				assert(errno == EAGAIN ||
+					errno == EWOULDBLOCK ||
+					errno == ENOBUFS);
+				break;
+			}
+			f->res.sent++;
+			busy = 1;
+		}
+
+		while ((rc = recv(s, in, msg_size, MSG_DONTWAIT)) >= 0) {
+			if (rc < (int)sizeof(*hdr))
+				continue;
+			f->res.received++;
+			f->res.bytes += rc;
+			busy = 1;
+		}
+		assert(errno == EAGAIN || errno == EWOULDBLOCK);
+		if (busy && !flow_rate)
+			continue;
+
+		if (!flow_rate) {
+			/* Wait for room in the socket, or for an echo. */
+			pfd.events |= POLLOUT;
+			assert(poll(&pfd, 1, -1) >= 0);
+			continue;
+		}
+
+		/* Sleep until the next datagram is due, or an echo comes. */
+		next = start + f->res.sent * 1e9 / flow_rate;
+		if (next > f->deadline)
+			next = f->deadline;
+		now = now_ns();
+		if (next <= now)
+			continue;
+		ts.tv_sec = (next - now) / 1000000000UL;
+		ts.tv_nsec = (next - now) % 1000000000UL;
+		assert(ppoll(&pfd, 1, &ts, NULL) >= 0);
+	}
+	f->res.elapsed_ns = now_ns() - start;
+
+	while (f->res.received < f->res.sent) {
+		struct pollfd pfd = {.fd = s, .events = POLLIN};
+		int rc = busy_poll_wait(&pfd, DGRAM_TIMEOUT_MS);
+
+		assert(rc >= 0);
+		if (!rc)
+			break;
+		rc = recv(s, in, msg_size, 0);
+		assert(rc >= 0);
+		if (rc < (int)sizeof(*hdr))
+			continue;
+		f->res.received++;
+		f->res.bytes += rc;
+	}
+	f->lost = f->res.sent - f->res.received;
+	pool_put(in);
+	pool_put(out);
+}
+
+static void *flow_main(void *arg)
+{
+	struct flow *f = arg;
+	struct perf_counters pc;
+	int s = flow_socket();
+
+	if (eopts.huge) {
+		pool_prefill(f->bulk ? BULK_SIZE : msg_size);
+		if (is_stream)
+			pool_prefill(POOL_MAX_SIZE);
+	}
+	if (eopts.perf && !f->bulk)
+		perf_open(&pc);
+	if (mode == MODE_DISCARD)
+		send_flow(f, s);
+	else if (mode == MODE_SOURCE)
+		recv_flow(f, s);
+	else if (mode == MODE_BIDIR)
+		bidir_flow(f, s);
+	else if (search)
+		paced_flow(f, s);
+	else if (is_stream)
+		stream_flow(f, s);
+	else
+		datagram_flow(f, s);
+	if (eopts.perf && !f->bulk) {
+		perf_read(&pc, &f->perf);
+		perf_close(&pc);
+	}
+	assert(!close(s));
+	return NULL;
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	assert(!getrusage(RUSAGE_SELF, &ru));
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * print_json(): Print the results of the run. Latency and message
+ * counts only cover the flows of -c, the bulk flows only add their
+ * throughput.
+ */
+static void print_json(struct flow *flows, double elapsed, double cpu)
+{
+	unsigned long received = 0, bytes = 0, lost = 0, failed = 0;
+	unsigned long bulk_bytes = 0, tx_bytes = 0, rx_bytes = 0;
+	double tx_cpu = 0, rx_cpu = 0;
+	struct perf_values pv;
+	struct hist h;
+	int i;
+
+	hist_init(&h);
+	memset(&pv, 0, sizeof(pv));
+	for (i = 0; i < concurrency + bulk_flows; i++) {
+		if (flows[i].bulk) {
+			bulk_bytes += flows[i].res.bytes;
+			failed += flows[i].failed ? 1 : 0;
+			continue;
+		}
+		perf_add(&pv, &flows[i].perf);
+		hist_merge(&h, &flows[i].latency);
+		if (mode == MODE_ECHO || mode == MODE_RPC) {
+			received += flows[i].res.received;
+			bytes += flows[i].res.bytes;
+		} else {
+			/* Messages one way or the other. */
+			received += flows[i].res.sent + flows[i].rx.received;
+			bytes += flows[i].res.bytes + flows[i].rx.bytes;
+			tx_bytes += flows[i].res.bytes;
+			rx_bytes += flows[i].rx.bytes;
+			tx_cpu += flows[i].tx_cpu;
+			rx_cpu += flows[i].rx_cpu;
+		}
+		lost += flows[i].lost;
+		failed += flows[i].failed ? 1 : 0;
+	}
+
+	printf("{\"proto\": \"%s\", \"size\": %i, \"concurrency\": %i, "
+		"\"depth\": %i, \"duration_s\": %.3f, \"messages\": %lu, "
+		"\"lost\": %lu, \"failed_flows\": %lu, \"msg_per_s\": %.1f, "
+		"\"mbit_per_s\": %.3f, \"cpu_pct\": %.1f, ",
+		is_stream ? "stream" : "datagram", msg_size, concurrency, depth,
+		elapsed, received, lost, failed, received / elapsed,
+		bytes * 8 / elapsed / 1e6, cpu / elapsed * 100);
+	if (mode != MODE_ECHO)
+		printf("\"mode\": \"%s\", ", mode_names[mode]);
+	if (mode == MODE_RPC)
+		printf("\"resp_size\": %i, ", resp_size);
+	if (mode != MODE_ECHO && mode != MODE_RPC)
+		printf("\"tx_mbit_per_s\": %.3f, \"tx_cpu_pct\": %.1f, "
+			"\"rx_mbit_per_s\": %.3f, \"rx_cpu_pct\": %.1f, ",
+			tx_bytes * 8 / elapsed / 1e6, tx_cpu / elapsed * 100,
+			rx_bytes * 8 / elapsed / 1e6, rx_cpu / elapsed * 100);
+	if (bulk_flows)
+		printf("\"bulk_flows\": %i, \"bulk_mbit_per_s\": %.3f, ",
+			bulk_flows, bulk_bytes * 8 / elapsed / 1e6);
+	if (eopts.busy_poll)
+		printf("\"busy_poll_us\": %i, ", eopts.busy_poll);
+	if (eopts.perf) {
+		printf("\"perf\": {");
+		perf_print_json(stdout, &pv, received, bytes);
+		printf("}, ");
+	}
+	printf("\"latency_us\": {\"min\": %.1f, \"mean\": %.1f, "
+		"\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+		"\"p999\": %.1f, \"max\": %.1f}}\n",
+		h.count ? h.min / 1e3 : 0.0,
+		h.count ? (double)h.sum / h.count / 1e3 : 0.0,
+		hist_percentile(&h, 50) / 1e3, hist_percentile(&h, 90) / 1e3,
+		hist_percentile(&h, 99) / 1e3,
+		hist_percentile(&h, 99.9) / 1e3, h.max / 1e3);
+}
+
+/* Start the flows, and wait until they are all done. */
+static void run_flows(struct flow *flows, int n, double seconds)
+{
+	unsigned long deadline = now_ns() + (unsigned long)(seconds * 1e9);
+	int i;
+
+	memset(flows, 0, n * sizeof(*flows));
+	for (i = 0; i < n; i++) {
+		flows[i].bulk = i >= concurrency;
+		flows[i].deadline = deadline;
+		hist_init(&flows[i].latency);
+		assert(!pthread_create(&flows[i].thread, NULL, flow_main,
+			&flows[i]));
+	}
+	for (i = 0; i < n; i++)
+		assert(!pthread_join(flows[i].thread, NULL));
+}
+
+/* A trial of the search of -L. */
+struct trial {
+	double		rate;		/* Offered, per second. */
+	double		loss_pct;
+	unsigned long	sent;
+};
+
+/**
+ * run_trial(): Offer @rate datagrams per second in all, 0 for as fast
+ * as the flows can send, for the duration of -d, after the settling time
+ * of the previous trial.
+ */
+static void run_trial(struct flow *flows, double rate, struct trial *t)
+{
+	static int settle;
+	unsigned long sent = 0, received = 0, elapsed_ns = 0;
+	int i;
+
+	if (settle)
+		usleep(SEARCH_SETTLE_MS * 1000);
+	settle = 1;
+	flow_rate = rate / concurrency;
+	run_flows(flows, concurrency, duration);
+	for (i = 0; i < concurrency; i++) {
+		sent += flows[i].res.sent;
+		received += flows[i].res.received;
+		if (flows[i].res.elapsed_ns > elapsed_ns)
+			elapsed_ns = flows[i].res.elapsed_ns;
+	}
+	/* What the flows managed to send, which may fall short of @rate. */
+	t->rate = elapsed_ns ? sent * 1e9 / elapsed_ns : 0;
+	t->loss_pct = sent ? (sent - received) * 100.0 / sent : 100;
+	t->sent = sent;
+	if (rate)
+		fprintf(stderr, "frame %i: offered %.0f/s of %.0f/s, "
+			"lost %.3f%%\n", msg_size + FRAME_OVERHEAD, t->rate,
+			rate, t->loss_pct);
+	else
+		fprintf(stderr, "frame %i: offered %.0f/s unpaced, "
+			"lost %.3f%%\n", msg_size + FRAME_OVERHEAD, t->rate,
+			t->loss_pct);
+}
+
+/**
+ * search_sizes(): For each frame size of -S, binary search the highest
+ * offered rate of datagrams of its payload whose loss is at most that of
+ * -L, and print a row of the table. Its bit rate counts whole frames.
+ * The first trial sends as fast as the flows can, which bounds the search
+ * from above. Progress goes to stderr.
+ */
+static void search_sizes(struct flow *flows)
+{
+	char *list = strdup(sizes), *tok, *save;
+	const char *sep = "";
+
+	assert(list);
+	printf("{\"proto\": \"datagram\", \"concurrency\": %i, "
+		"\"trial_s\": %.3f, \"max_loss_pct\": %.3f, \"rates\": [",
+		concurrency, duration, max_loss_pct);
+	fflush(stdout);
+	for (tok = strtok_r(list, ",", &save); tok;
+		tok = strtok_r(NULL, ",", &save)) {
+		struct trial t, best = {0, 0, 0};
+		double lo = 0, hi;
+		int trials = 1;
+
+		msg_size = atoi(tok) - FRAME_OVERHEAD;
+		run_trial(flows, 0, &t);
+		hi = t.rate;
+		if (t.loss_pct <= max_loss_pct) {
+			best = t;
+			lo = hi;
+		}
+		while (hi - lo > hi * SEARCH_RESOLUTION &&
+			trials < SEARCH_TRIALS) {
+			double rate = (lo + hi) / 2;
+
+			run_trial(flows, rate, &t);
+			trials++;
+			if (t.loss_pct <= max_loss_pct) {
+				best = t;
+				lo = rate;
+			} else {
+				hi = rate;
+			}
+		}
+
+		printf("%s{\"frame_size\": %i, \"payload_size\": %i, "
+			"\"msg_per_s\": %.1f, \"mbit_per_s\": %.3f, "
+			"\"loss_pct\": %.3f, \"trials\": %i}", sep,
+			msg_size + FRAME_OVERHEAD, msg_size, best.rate,
+			best.rate * (msg_size + FRAME_OVERHEAD) * 8 / 1e6,
+			best.loss_pct, trials);
+		fflush(stdout);
+		sep = ", ";
+	}
+	printf("]}\n");
+	free(list);
+}
+
+/* Return nonzero if the payload of every frame size of -S fits a
+ * datagram with a frame header.
+ */
+static int valid_sizes(void)
+{
+	const char *p = sizes;
+
+	while (1) {
+		char *end;
+		long size = strtol(p, &end, 10);
+
+		if (end == p || size - FRAME_OVERHEAD <
+			(long)sizeof(struct frame_hdr) ||
+			size - FRAME_OVERHEAD > MAX_UDP)
+			return 0;
+		if (!*end)
+			return 1;
+		if (*end != ',')
+			return 0;
+		p = end + 1;
+	}
+}
+
+static void usage(const char *prog)
+{
+	printf("usage:\t%s [options] "
+		"<'datagram' | 'stream'> 'ip' srvip_addr port\n", prog);
+	printf(      "\t%s [options] "
+		"<'datagram' | 'stream'> 'xip' cli_addr_file srv_addr_file\n",
+		prog);
+	printf("options:\n"
+		"\t-c flows\tnumber of concurrent flows (default 1)\n"
+		"\t-s size\t\tmessage size in bytes (default 64)\n"
+		"\t-d seconds\tduration of the run (default 5)\n"
+		"\t-D depth\tmessages in flight per flow (default 1)\n"
+		"\t-b flows\tnumber of bulk stream flows to run alongside, "
+		"each keeps\n\t\t\t%i messages of %i bytes in flight\n"
+		"\t-m mode\t\techo (default); discard to only send, source "
+		"to only\n\t\t\treceive (reverse), or bidir to send and "
+		"receive at once\n\t\t\t(streams only), against eserv in "
+		"the same mode; these\n\t\t\treport the throughput and "
+		"CPU of each direction and\n\t\t\tno latency, and ignore "
+		"-D;\n\t\t\trpc to ask eserv -m rpc for "
+		"responses of the size of -r\n"
+		"\t-r size\t\tresponse size of -m rpc in bytes (default "
+		"the message size)\n"
+		"\t-L loss\t\tsearch the highest rate of echoed "
+		"datagrams that loses at\n\t\t\tmost loss percent, for "
+		"each frame size of -S, and print\n\t\t\tthe rates; each "
+		"trial lasts -d seconds, -s and -D\n\t\t\tare ignored\n"
+		"\t-S sizes\tcomma-separated Ethernet frame sizes of -L, "
+		"each datagram\n\t\t\tcarries a frame less %i bytes of "
+		"headers and FCS\n\t\t\t(default %s)\n"
+		"\t-P\t\treport performance counters per echo\n"
+		"\t-H\t\tback buffers with hugepages, prefault and pin "
+		"them\n"
+		"\t-B us\t\tspin up to us microseconds on the sockets before "
+		"blocking\n", BULK_DEPTH, BULK_SIZE, FRAME_OVERHEAD,
+		SEARCH_SIZES);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct flow *flows;
+	unsigned long start;
+	double cpu;
+	int opt;
+
+	/* Stop at the first positional parameter, check_cli_params()
+	 * continues from there.
+	 */
+	while ((opt = getopt(argc, argv, "+c:s:d:D:b:m:r:L:S:PHB:")) != -1) {
+		switch (opt) {
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'D':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			bulk_flows = atoi(optarg);
+			break;
+		case 'r':
+			resp_size = atoi(optarg);
+			break;
+		case 'L':
+			search = 1;
+			max_loss_pct = atof(optarg);
+			break;
+		case 'S':
+			sizes = optarg;
+			break;
+		case 'm': {
+			int m = parse_mode(optarg);
+
+			if (m < 0)
+				usage(argv[0]);
+			mode = m;
+			break;
+		}
+		case 'P':
+			eopts.perf = 1;
+			break;
+		case 'H':
+			eopts.huge = 1;
+			break;
+		case 'B': {
+			char *end;
+
+			eopts.busy_poll = strtol(optarg, &end, 0);
+			if (*end || eopts.busy_poll < 0)
+				usage(argv[0]);
+			break;
+		}
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	is_xia = check_cli_params(&is_stream, &argc, &argv);
+	/* The free lists are per thread, each flow prefills its own. */
+	if (eopts.huge)
+		pool_init(POOL_HUGE | POOL_LOCK);
+	if (!resp_size)
+		resp_size = msg_size;
+	if (concurrency <= 0 || depth <= 0 || duration <= 0 ||
+		bulk_flows < 0 ||
+		(bulk_flows && (!is_stream || mode != MODE_ECHO)) ||
+		msg_size < (int)sizeof(struct frame_hdr) ||
+		(!is_stream && msg_size > MAX_UDP) ||
+		(mode == MODE_BIDIR && !is_stream) || mode == MODE_TWAMP ||
+		(mode == MODE_RPC &&
+		(msg_size < (int)sizeof(struct rpc_hdr) ||
+		resp_size < (int)sizeof(struct frame_hdr) ||
+		(!is_stream && resp_size > MAX_UDP))) ||
+		(search && (is_stream || mode != MODE_ECHO ||
+		max_loss_pct < 0 || max_loss_pct >= 100 || !valid_sizes())))
+		usage(argv[0]);
+	cli = get_cli_addr(is_xia, argc, argv, &cli_len);
+	assert(cli);
+	srv = get_srv_addr(is_xia, argc, argv, &srv_len);
+	assert(srv);
+
+	flows = calloc(concurrency + bulk_flows, sizeof(*flows));
+	assert(flows);
+	if (search) {
+		search_sizes(flows);
+	} else {
+		cpu = cpu_seconds();
+		start = now_ns();
+		run_flows(flows, concurrency + bulk_flows, duration);
+		print_json(flows, (now_ns() - start) / 1e9,
+			cpu_seconds() - cpu);
+	}
+	/* What all the flows pinned. */
+	if (eopts.huge)
+		pool_report(stderr, NULL);
+
+	free(flows);
+	free(srv);
+	free(cli);
+	return 0;
+}
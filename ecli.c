@@ -13,17 +13,215 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include "eutils.h"
+#include "etstamp.h"
+#include "eperf.h"
+#include "ehist.h"
+#include "eframe.h"
+#include "epool.h"
+#include "ezcopy.h"
+#include "etwamp.h"
+
+/* How long -t waits for each reflected packet. */
+#define TWAMP_TIMEOUT_MS 1000
+
+/* Signed one-way delays of -t, which clocks out of sync can make
+ * negative.
+ */
+struct one_way {
+	unsigned long	count;
+	double		min_us;
+	double		max_us;
+	double		sum_us;
+};
 
 static void stream_process_text(int s, char *input, int n_read)
 {
-	assert(write(s, input, n_read) == n_read);
+	stream_send(s, input, n_read);
 	read_write(s, stdout, n_read);
 }
 
+/**
+ * stream_process_pipeline(): Parse "-p count size [depth]", pipeline that
+ * many framed messages, and report their latencies.
+ */
+static void stream_process_pipeline(int s, const char *args)
+{
+	struct pipeline_result res;
+	struct hist h;
+	unsigned long count;
+	double msgs = 0, mbytes = 0;
+	int size, depth = 16;
+
+	if (sscanf(args, "%lu %i %i", &count, &size, &depth) < 2 ||
+		size < (int)sizeof(struct frame_hdr) || depth <= 0) {
+		printf("usage: -p count size [depth], size >= %zu\n",
+			sizeof(struct frame_hdr));
+		return;
+	}
+
+	hist_init(&h);
+	if (stream_pipeline(s, count, size, 0, depth, 0, &h, &res))
+		fprintf(stderr, "Connection failed after %lu of %lu echoes\n",
+			res.received, count);
+	echoes += res.received;
+	echoed_bytes += res.bytes;
+	/* With a count of 0, nothing is exchanged and no time passes. */
+	if (res.elapsed_ns) {
+		msgs = res.received * 1e9 / res.elapsed_ns;
+		mbytes = res.bytes * 1e3 / res.elapsed_ns;
+	}
+	printf("pipeline: sent=%lu received=%lu out_of_order=%lu "
+		"%.0f msg/s %.1f MB/s\n", res.sent, res.received,
+		res.out_of_order, msgs, mbytes);
+	hist_print(stdout, "latency", &h);
+}
+
+static void one_way_add(struct one_way *w, double us)
+{
+	if (!w->count || us < w->min_us)
+		w->min_us = us;
+	if (!w->count || us > w->max_us)
+		w->max_us = us;
+	w->sum_us += us;
+	w->count++;
+}
+
+static void one_way_print(const char *name, const struct one_way *w)
+{
+	if (w->count)
+		printf("%s: min=%.1fus mean=%.1fus max=%.1fus\n", name,
+			w->min_us, w->sum_us / w->count, w->max_us);
+}
+
+/* Nanoseconds from the NTP timestamp @from to @to, host byte order. */
+static inline double ntp_delta_ns(uint64_t from, uint64_t to)
+{
+	return (double)twamp_ntp_ns(to) - (double)twamp_ntp_ns(from);
+}
+
+/**
+ * datagram_process_twamp(): Parse "-t count [size [interval_ms]]", send
+ * that many TWAMP-Light test packets, one at a time, to a reflector such
+ * as eserv -m twamp, and report their delays. The round trip leaves out
+ * the time spent in the reflector. The one-way delays are only as good as
+ * the synchronization of the clocks of both ends, see their error
+ * estimates.
+ */
+static void datagram_process_twamp(int s, struct sockaddr *srv,
+	socklen_t srv_len, const char *args)
+{
+	unsigned long count, i, lost = 0;
+	int size = TWAMP_MIN_SIZE, interval_ms = 0, ttl = 255, old_ttl;
+	socklen_t ttl_len = sizeof(old_ttl);
+	uint16_t error = twamp_error_estimate(), refl_error = 0;
+	struct one_way fwd, bwd;
+	struct hist h;
+	char *out, *in;
+
+	if (sscanf(args, "%lu %i %i", &count, &size, &interval_ms) < 1 ||
+		size < TWAMP_MIN_SIZE || size > MAX_UDP || interval_ms < 0) {
+		printf("usage: -t count [size [interval_ms]], size >= %i\n",
+			TWAMP_MIN_SIZE);
+		return;
+	}
+	/* -T already enabled RX timestamps. Senders use the largest TTL,
+	 * so the reflector can tell how many hops the packets crossed; the
+	 * other commands get the TTL back.
+	 */
+	if (!eopts.tstamp && twamp_enable(s, 0))
+		return;
+	assert(!getsockopt(s, IPPROTO_IP, IP_TTL, &old_ttl, &ttl_len));
+	assert(!setsockopt(s, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl)));
+
+	out = pool_get(size);
+	in = pool_get(MAX_UDP);
+	memset(out, 0, size);
+	memset(&fwd, 0, sizeof(fwd));
+	memset(&bwd, 0, sizeof(bwd));
+	hist_init(&h);
+	for (i = 0; i < count; i++) {
+		struct twamp_test *t = (struct twamp_test *)out;
+		const struct twamp_reflect *r =
+			(const struct twamp_reflect *)in;
+		unsigned long deadline;
+
+		t->seq = htobe32(i);
+		t->error = htobe16(error);
+		t->ts = htobe64(twamp_now());
+		send_packet(s, out, size, srv, srv_len);
+		deadline = now_ns() + TWAMP_TIMEOUT_MS * 1000000UL;
+
+		/* Skip late reflections of earlier packets. The TX timestamps
+		 * of -T wake the poll too, so only the deadline ends the wait.
+		 */
+		while (1) {
+			struct pollfd pfd = {.fd = s, .events = POLLIN};
+			unsigned long now = now_ns();
+			uint64_t t1, t2, t3, t4;
+			double rtt;
+			int rc;
+
+			if (now >= deadline) {
+				lost++;
+				break;
+			}
+			rc = busy_poll_wait(&pfd,
+				(deadline - now + 999999) / 1000000);
+			assert(rc >= 0);
+			if (eopts.tstamp)
+				tstamp_drain_tx(s);
+			rc = twamp_recv(s, in, MAX_UDP, MSG_DONTWAIT, NULL,
+				NULL, &t4, NULL);
+			if (rc < 0) {
+				assert(errno == EAGAIN || errno == EWOULDBLOCK);
+				continue;
+			}
+			if (rc < TWAMP_MIN_SIZE || be32toh(r->sender_seq) != i)
+				continue;
+			if (!t4)
+				t4 = twamp_now();
+			t1 = be64toh(r->sender_ts);
+			t2 = be64toh(r->rx_ts);
+			t3 = be64toh(r->ts);
+			refl_error = be16toh(r->error);
+
+			rtt = ntp_delta_ns(t1, t4) - ntp_delta_ns(t2, t3);
+			if (rtt >= 0)
+				hist_add(&h, rtt);
+			one_way_add(&fwd, ntp_delta_ns(t1, t2) / 1e3);
+			one_way_add(&bwd, ntp_delta_ns(t3, t4) / 1e3);
+			echoes++;
+			echoed_bytes += rc;
+			break;
+		}
+		if (interval_ms && i + 1 < count)
+			usleep(interval_ms * 1000);
+	}
+
+	printf("twamp: sent=%lu received=%lu lost=%lu\n", count,
+		count - lost, lost);
+	hist_print(stdout, "round trip", &h);
+	one_way_print("forward", &fwd);
+	one_way_print("backward", &bwd);
+	printf("error estimates: sender %.1fus%s, reflector %.1fus%s\n",
+		twamp_error_seconds(error) * 1e6,
+		error & TWAMP_ERROR_SYNC ? " synchronized" : "",
+		twamp_error_seconds(refl_error) * 1e6,
+		refl_error & TWAMP_ERROR_SYNC ? " synchronized" : "");
+	assert(!setsockopt(s, IPPROTO_IP, IP_TTL, &old_ttl, sizeof(old_ttl)));
+	pool_put(in);
+	pool_put(out);
+}
+
 /**
  * datagram_process_text(): Sends and receives a message from the echo server.
  */
@@ -36,10 +234,13 @@ static void datagram_process_text(int s, struct sockaddr *srv,
 
 int main(int argc, char *argv[])
 {
+	struct perf_counters perf;
 	struct sockaddr *cli, *srv;
 	int s, is_xia, is_stream, cli_len, srv_len, chunk_size;
 
-	is_xia = check_cli_params(&is_stream, argc, argv);
+	is_xia = check_cli_params(&is_stream, &argc, &argv);
+	if (eopts.huge)
+		pool_init(POOL_HUGE | POOL_LOCK | POOL_PREFILL);
 
 	s = any_socket(is_xia, is_stream);
 	assert(s >= 0);
@@ -52,14 +253,34 @@ int main(int argc, char *argv[])
 	if (is_stream)
 		assert(!connect(s, srv, srv_len));
 
+	/* TCP only accepts timestamp IDs on connected sockets. */
+	if (eopts.tstamp && tstamp_enable(s, is_stream))
+		eopts.tstamp = 0;
+	if (eopts.perf && !perf_open(&perf))
+		fprintf(stderr, "No performance counter available\n");
+
 	chunk_size = is_stream ? 2048 : (is_xia ? 512 : MAX_UDP);
+	/* Chunks must reach the zero-copy threshold, and span pages. */
+	if ((eopts.zerocopy || eopts.rx_zerocopy) && is_stream)
+		chunk_size = POOL_MAX_SIZE;
 	while (1) {
 		char input[512];
 		int n_read = read_command(input, sizeof(input));
 		if (n_read <= 0)
 			break;
 
-		if (is_file(input)) {
+		if (is_twamp(input)) {
+			if (!is_stream && !is_xia)
+				datagram_process_twamp(s, srv, srv_len,
+					input + 3);
+			else
+				printf("TWAMP requires datagram ip mode.\n");
+		} else if (is_pipeline(input)) {
+			if (is_stream)
+				stream_process_pipeline(s, input + 3);
+			else
+				printf("Pipelining requires stream mode.\n");
+		} else if (is_file(input)) {
 			if (is_stream)
 				stream_process_file(s, input + 3, chunk_size,
 					1, NULL);
@@ -77,8 +298,24 @@ int main(int argc, char *argv[])
 		printf("\n\n");
 	}
 
+	if (eopts.tstamp)
+		tstamp_summary(stderr);
+	if (eopts.zerocopy)
+		zc_report(stderr, NULL);
+	if (eopts.rx_zerocopy)
+		zc_rx_report(stderr, NULL);
+	if (eopts.perf) {
+		struct perf_values pv;
+		perf_read(&perf, &pv);
+		perf_print(stderr, "client counters", &pv, echoes,
+			echoed_bytes);
+		perf_close(&perf);
+	}
+
 	free(srv);
 	free(cli);
+	if (eopts.rx_zerocopy)
+		read_write_zc_end();
 	assert(!close(s));
 	return 0;
 }
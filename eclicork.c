@@ -16,6 +16,10 @@
 #include <arpa/inet.h>
 #include <linux/udp.h>
 #include "eutils.h"
+#include "etstamp.h"
+#include "eperf.h"
+#include "epool.h"
+#include "ezcopy.h"
 
 #define CORK_SIZE 64
 #define CORK_TIMES (512/CORK_SIZE)
@@ -94,10 +98,13 @@ static void process_text(int s, const struct sockaddr *srv, socklen_t srv_len,
 
 int main(int argc, char *argv[])
 {
+	struct perf_counters perf;
 	struct sockaddr *cli, *srv;
 	int is_stream, s, cli_len, srv_len;
 
-	is_xia = check_cli_params(&is_stream, argc, argv);
+	is_xia = check_cli_params(&is_stream, &argc, &argv);
+	if (eopts.huge)
+		pool_init(POOL_HUGE | POOL_LOCK | POOL_PREFILL);
 
 	if (is_stream) {
 		/* XXX Implement stream support. */
@@ -112,6 +119,10 @@ int main(int argc, char *argv[])
 	srv = get_srv_addr(is_xia, argc, argv, &srv_len);
 	assert(srv);
 	any_bind(is_xia, 0, s, cli, cli_len);
+	if (eopts.tstamp && tstamp_enable(s, is_stream))
+		eopts.tstamp = 0;
+	if (eopts.perf && !perf_open(&perf))
+		fprintf(stderr, "No performance counter available\n");
 
 	cork(s);
 	while (1) {
@@ -133,8 +144,22 @@ int main(int argc, char *argv[])
 		printf("\n");
 	}
 
+	if (eopts.tstamp)
+		tstamp_summary(stderr);
+	if (eopts.zerocopy)
+		zc_report(stderr, NULL);
+	if (eopts.perf) {
+		struct perf_values pv;
+		perf_read(&perf, &pv);
+		perf_print(stderr, "client counters", &pv, echoes,
+			echoed_bytes);
+		perf_close(&perf);
+	}
+
 	free(srv);
 	free(cli);
+	if (eopts.rx_zerocopy)
+		read_write_zc_end();
 	assert(!close(s));
 	return 0;
 }
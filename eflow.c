@@ -0,0 +1,244 @@
+/*
+ * eflow.c
+ *
+ * This file implements the per-peer flow table of the echo server.
+ *
+ * As in elimit.c, slots are freed with backward-shift deletion, so the
+ * table needs no tombstones however many flows come and go.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "eutils.h"
+#include "eflow.h"
+
+static void *array(uint32_t slots, size_t size)
+{
+	void *a = calloc(slots, size);
+
+	assert(a);
+	return a;
+}
+
+void flow_init(struct flow_table *t, unsigned int flows, unsigned int top)
+{
+	uint32_t slots = 16;
+
+	assert(flows > 0 && flows <= (1U << 30));
+	assert(top > 0 && top <= flows);
+	while (slots / 4 * 3 < flows)
+		slots <<= 1;
+
+	memset(t, 0, sizeof(*t));
+	t->mask = slots - 1;
+	t->max_count = flows;
+	t->top = top;
+	t->keys = array(slots, sizeof(*t->keys));
+	t->peers = array(slots, sizeof(*t->peers));
+	t->msgs = array(slots, sizeof(*t->msgs));
+	t->bytes = array(slots, sizeof(*t->bytes));
+	t->first_ns = array(slots, sizeof(*t->first_ns));
+	t->last_ns = array(slots, sizeof(*t->last_ns));
+	t->lat_sum_ns = array(slots, sizeof(*t->lat_sum_ns));
+	t->lat_max_ns = array(slots, sizeof(*t->lat_max_ns));
+}
+
+static void move(struct flow_table *t, uint32_t to, uint32_t from)
+{
+	t->peers[to] = t->peers[from];
+	t->msgs[to] = t->msgs[from];
+	t->bytes[to] = t->bytes[from];
+	t->first_ns[to] = t->first_ns[from];
+	t->last_ns[to] = t->last_ns[from];
+	t->lat_sum_ns[to] = t->lat_sum_ns[from];
+	t->lat_max_ns[to] = t->lat_max_ns[from];
+	/* Last, so reports see a complete flow. */
+	t->keys[to] = t->keys[from];
+}
+
+/**
+ * evict(): Free slot @i, moving back the flows after it that would
+ * otherwise become unreachable.
+ */
+static void evict(struct flow_table *t, uint32_t i)
+{
+	uint32_t j = i;
+
+	while (1) {
+		uint32_t home;
+
+		j = (j + 1) & t->mask;
+		if (!t->keys[j])
+			break;
+		home = t->keys[j] & t->mask;
+		/* A flow can move back to @i if @i lies between its home
+		 * slot and its slot @j, cyclically.
+		 */
+		if (((j - home) & t->mask) < ((j - i) & t->mask))
+			continue;
+		move(t, i, j);
+		i = j;
+	}
+	t->keys[i] = 0;
+	t->count--;
+	t->evictions++;
+}
+
+/**
+ * evict_one(): Evict the least recently seen of the next
+ * FLOW_EVICT_SAMPLE flows after the cursor.
+ */
+static void evict_one(struct flow_table *t)
+{
+	uint32_t i = t->cursor, victim = 0;
+	uint64_t oldest = UINT64_MAX;
+	int sampled = 0;
+
+	while (sampled < FLOW_EVICT_SAMPLE && sampled < (int)t->count) {
+		i = (i + 1) & t->mask;
+		if (!t->keys[i])
+			continue;
+		sampled++;
+		if (t->last_ns[i] < oldest) {
+			oldest = t->last_ns[i];
+			victim = i;
+		}
+	}
+	t->cursor = i;
+	evict(t, victim);
+}
+
+static void set_peer(struct flow_peer *p, const struct sockaddr *addr)
+{
+	memset(p, 0, sizeof(*p));
+	p->family = addr->sa_family;
+	switch (addr->sa_family) {
+	case AF_INET: {
+		const struct sockaddr_in *in =
+			(const struct sockaddr_in *)addr;
+
+		p->port = in->sin_port;
+		memcpy(p->addr, &in->sin_addr, sizeof(in->sin_addr));
+		break;
+	}
+	case AF_INET6: {
+		const struct sockaddr_in6 *in6 =
+			(const struct sockaddr_in6 *)addr;
+
+		p->port = in6->sin6_port;
+		memcpy(p->addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+		break;
+	}
+	}
+}
+
+void flow_account(struct flow_table *t, const struct sockaddr *addr,
+	socklen_t len, unsigned long msgs, unsigned long bytes,
+	unsigned long lat_sum_ns, unsigned long lat_max_ns,
+	unsigned long now_ns)
+{
+	uint64_t key = addr_hash(addr, len, 1);
+	uint32_t i;
+
+	for (i = key & t->mask; t->keys[i]; i = (i + 1) & t->mask)
+		if (t->keys[i] == key)
+			goto found;
+
+	if (t->count >= t->max_count) {
+		evict_one(t);
+		/* Eviction may have moved flows into the probe sequence
+		 * of @key, look for its free slot again.
+		 */
+		for (i = key & t->mask; t->keys[i]; i = (i + 1) & t->mask)
+			;
+	}
+	set_peer(&t->peers[i], addr);
+	t->msgs[i] = t->bytes[i] = 0;
+	t->lat_sum_ns[i] = t->lat_max_ns[i] = 0;
+	t->first_ns[i] = now_ns;
+	t->keys[i] = key;
+	t->count++;
+
+found:
+	t->msgs[i] += msgs;
+	t->bytes[i] += bytes;
+	t->last_ns[i] = now_ns;
+	t->lat_sum_ns[i] += lat_sum_ns;
+	if (lat_max_ns > t->lat_max_ns[i])
+		t->lat_max_ns[i] = lat_max_ns;
+}
+
+static void print_peer(FILE *f, const struct flow_peer *p, uint64_t key)
+{
+	char str[INET6_ADDRSTRLEN];
+
+	switch (p->family) {
+	case AF_INET:
+		fprintf(f, "%s:%u", inet_ntop(AF_INET, p->addr, str,
+			sizeof(str)), ntohs(p->port));
+		break;
+	case AF_INET6:
+		fprintf(f, "[%s]:%u", inet_ntop(AF_INET6, p->addr, str,
+			sizeof(str)), ntohs(p->port));
+		break;
+	default:
+		/* XIA addresses are too long to keep. */
+		fprintf(f, "family %u #%016llx", p->family,
+			(unsigned long long)key);
+		break;
+	}
+}
+
+/* Flows may be seen after a report starts. */
+static inline double secs_ago(unsigned long now, uint64_t then)
+{
+	return now > then ? (now - then) / 1e9 : 0.0;
+}
+
+void flow_report(FILE *f, void *arg)
+{
+	struct flow_table *t = arg;
+	uint32_t *top = calloc(t->top + 1, sizeof(*top));
+	unsigned long now = now_ns();
+	unsigned int n = 0, k;
+	uint32_t i;
+
+	assert(top);
+	/* Keep the slots of the top flows sorted by bytes, descending. */
+	for (i = 0; i <= t->mask; i++) {
+		uint64_t bytes;
+
+		if (!t->keys[i])
+			continue;
+		bytes = t->bytes[i];
+		if (n == t->top && (!n || bytes <= t->bytes[top[n - 1]]))
+			continue;
+		for (k = n < t->top ? n++ : n - 1;
+			k > 0 && t->bytes[top[k - 1]] < bytes; k--)
+			top[k] = top[k - 1];
+		top[k] = i;
+	}
+
+	fprintf(f, "flows: %u tracked, %lu evicted\n", t->count,
+		t->evictions);
+	for (k = 0; k < n; k++) {
+		uint32_t s = top[k];
+		uint64_t msgs = t->msgs[s];
+
+		fprintf(f, "  ");
+		print_peer(f, &t->peers[s], t->keys[s]);
+		fprintf(f, ": %llu msgs, %llu bytes, latency mean=%.1fus "
+			"max=%.1fus, first seen %.1fs ago, last seen "
+			"%.1fs ago\n", (unsigned long long)msgs,
+			(unsigned long long)t->bytes[s],
+			msgs ? t->lat_sum_ns[s] / 1000.0 / msgs : 0.0,
+			t->lat_max_ns[s] / 1000.0,
+			secs_ago(now, t->first_ns[s]),
+			secs_ago(now, t->last_ns[s]));
+	}
+	free(top);
+}
@@ -0,0 +1,74 @@
+/*
+ * eflow.h
+ *
+ * A header file for the per-peer flow table of the echo server.
+ *
+ */
+
+#ifndef _ECHO_FLOW_H
+#define _ECHO_FLOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Flows that flow_account() compares to pick one to evict. */
+#define FLOW_EVICT_SAMPLE	8
+
+/* Enough of an address to print it. */
+struct flow_peer {
+	uint16_t	family;
+	uint16_t	port;		/* Network byte order. */
+	uint8_t		addr[16];	/* IPv4 or IPv6 only. */
+};
+
+/* Traffic of the peers, in an open-addressing table with linear probing.
+ * Each field has its own array, so probing only walks @keys, and a
+ * report only walks @keys and @bytes.
+ *
+ * The table has a fixed number of slots, the smallest power of 2 that
+ * keeps it at most 3/4 full with @max_count flows, so it can be as little
+ * as 3/8 full then. A new flow then evicts the least recently seen of
+ * FLOW_EVICT_SAMPLE flows after a rotating cursor, which approximates
+ * evicting the least recently seen flow.
+ *
+ * Only one thread may update the table. Reports read it as it changes,
+ * so they can miss or repeat a flow that moves during the report.
+ */
+struct flow_table {
+	uint32_t		mask;
+	uint32_t		count;
+	uint32_t		max_count;
+	uint32_t		cursor;		/* Of eviction. */
+	unsigned long		evictions;
+	unsigned int		top;		/* Flows to report. */
+
+	/* addr_hash() of the peers, 0 if free. */
+	uint64_t		*keys;
+	struct flow_peer	*peers;
+	uint64_t		*msgs;
+	uint64_t		*bytes;
+	uint64_t		*first_ns;
+	uint64_t		*last_ns;
+	uint64_t		*lat_sum_ns;
+	uint64_t		*lat_max_ns;
+};
+
+/* Track up to @flows flows, and report the @top of them that moved the
+ * most bytes.
+ */
+void flow_init(struct flow_table *t, unsigned int flows, unsigned int top);
+
+/* Add @msgs messages of @bytes bytes in all from the peer @addr at
+ * @now_ns, see now_ns(), to its flow. Echoing them took @lat_sum_ns in
+ * all, and @lat_max_ns at most. O(1) on average.
+ */
+void flow_account(struct flow_table *t, const struct sockaddr *addr,
+	socklen_t len, unsigned long msgs, unsigned long bytes,
+	unsigned long lat_sum_ns, unsigned long lat_max_ns,
+	unsigned long now_ns);
+
+/* Print the top flows by bytes of the struct flow_table @arg. */
+void flow_report(FILE *f, void *arg);
+
+#endif /* _ECHO_FLOW_H */
@@ -0,0 +1,213 @@
+/*
+ * eframe.c
+ *
+ * This file implements the length-prefixed message framing of the echo
+ * clients.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include "eutils.h"
+#include "ehist.h"
+#include "eframe.h"
+#include "epool.h"
+
+#define RX_CHUNK (64 * 1024)
+/* How long echoes in flight are waited for after the deadline. */
+#define DRAIN_MS 1000
+
+/* State of the frame being sent. */
+struct tx_state {
+	char		*frame;
+	int		size;
+	int		off;
+	uint32_t	next_id;
+	int		resp_size;
+};
+
+/* State of the frame being received. */
+struct rx_state {
+	struct frame_hdr	hdr;
+	int			hdr_got;
+	int			body_left;
+	uint32_t		next_id;
+};
+
+static void build_frame(struct tx_state *tx)
+{
+	struct frame_hdr *hdr = (struct frame_hdr *)tx->frame;
+
+	hdr->len = htobe32(tx->size);
+	hdr->id = htobe32(tx->next_id);
+	hdr->ts = htobe64(now_ns());
+	if (tx->resp_size)
+		((struct rpc_hdr *)hdr)->resp_len = htobe32(tx->resp_size);
+	tx->next_id++;
+	tx->off = 0;
+}
+
+/**
+ * send_some(): Send as much of the current frame as the socket takes
+ * without blocking. Return 1 when the frame is complete, 0 if the socket
+ * is full, and -1 on error.
+ */
+static int send_some(int s, struct tx_state *tx)
+{
+	while (tx->off < tx->size) {
+		ssize_t n = send(s, tx->frame + tx->off, tx->size - tx->off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		tx->off += n;
+	}
+	return 1;
+}
+
+/**
+ * parse(): Consume @len received bytes. Return the number of frames
+ * completed.
+ */
+static int parse(struct rx_state *rx, const char *buf, int len,
+	struct hist *h, struct pipeline_result *res)
+{
+	int frames = 0;
+
+	while (len > 0) {
+		int take;
+
+		if (rx->hdr_got < (int)sizeof(rx->hdr)) {
+			take = sizeof(rx->hdr) - rx->hdr_got;
+			if (take > len)
+				take = len;
+			memcpy((char *)&rx->hdr + rx->hdr_got, buf, take);
+			rx->hdr_got += take;
+			buf += take;
+			len -= take;
+			if (rx->hdr_got < (int)sizeof(rx->hdr))
+				break;
+			rx->body_left = be32toh(rx->hdr.len) -
+				sizeof(rx->hdr);
+			assert(rx->body_left >= 0);
+		}
+
+		take = rx->body_left < len ? rx->body_left : len;
+		rx->body_left -= take;
+		buf += take;
+		len -= take;
+		if (rx->body_left)
+			break;
+
+		/* Frame complete. */
+		hist_add(h, now_ns() - be64toh(rx->hdr.ts));
+		if (be32toh(rx->hdr.id) != rx->next_id)
+			res->out_of_order++;
+		rx->next_id = be32toh(rx->hdr.id) + 1;
+		rx->hdr_got = 0;
+		frames++;
+	}
+	return frames;
+}
+
+int stream_pipeline(int s, unsigned long count, int size, int resp_size,
+	int depth, unsigned long deadline, struct hist *h,
+	struct pipeline_result *res)
+{
+	struct tx_state tx;
+	struct rx_state rx;
+	unsigned long start;
+	char *rx_buf;
+
+	assert(size >= (int)(resp_size ? sizeof(struct rpc_hdr) :
+		sizeof(struct frame_hdr)));
+	assert(!resp_size || resp_size >= (int)sizeof(struct frame_hdr));
+	assert(depth > 0);
+
+	memset(res, 0, sizeof(*res));
+	memset(&tx, 0, sizeof(tx));
+	memset(&rx, 0, sizeof(rx));
+	tx.size = size;
+	tx.resp_size = resp_size;
+	tx.frame = pool_get(size);
+	memset(tx.frame, 'p', size);
+	tx.off = size;
+	rx_buf = pool_get(RX_CHUNK);
+
+	start = now_ns();
+	while (res->received < count) {
+		struct pollfd pfd = {.fd = s, .events = POLLIN};
+		unsigned long now, drain_end = deadline + DRAIN_MS * 1000000UL;
+		int can_send, timeout_ms = -1, rc;
+
+		if (deadline) {
+			/* An echo that never comes must not hang the run. */
+			now = now_ns();
+			if (now >= drain_end)
+				goto failed;
+			timeout_ms = (drain_end - now) / 1000000 + 1;
+		}
+		if (deadline && tx.off == tx.size && now >= deadline) {
+			/* Stop sending. */
+			count = res->sent;
+			if (res->received == count)
+				break;
+		}
+
+		can_send = res->sent < count &&
+			res->sent - res->received < (unsigned long)depth;
+		if (can_send || tx.off < tx.size)
+			pfd.events |= POLLOUT;
+		rc = busy_poll_wait(&pfd, timeout_ms);
+		assert(rc >= 0);
+		if (!rc)
+			continue;
+
+		if (pfd.revents & POLLOUT) {
+			int rc;
+
+			/* Keep writing until the window closes or the
+			 * socket is full.
+			 */
+			while (1) {
+				if (tx.off == tx.size) {
+					if (!(res->sent < count &&
+						res->sent - res->received <
+						(unsigned long)depth))
+						break;
+					build_frame(&tx);
+					res->sent++;
+				}
+				rc = send_some(s, &tx);
+				if (rc < 0)
+					goto failed;
+				if (!rc)
+					break;
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+			ssize_t n = recv(s, rx_buf, RX_CHUNK, MSG_DONTWAIT);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if (n <= 0)
+				goto failed;
+			res->bytes += n;
+			res->received += parse(&rx, rx_buf, n, h, res);
+		}
+	}
+	res->elapsed_ns = now_ns() - start;
+	pool_put(rx_buf);
+	pool_put(tx.frame);
+	return 0;
+
+failed:
+	res->elapsed_ns = now_ns() - start;
+	pool_put(rx_buf);
+	pool_put(tx.frame);
+	return -1;
+}
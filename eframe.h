@@ -0,0 +1,58 @@
+/*
+ * eframe.h
+ *
+ * A header file for the length-prefixed message framing that the echo
+ * clients use to pipeline messages over stream sockets.
+ * eserv is byte-transparent, except in its rpc mode, which reads the
+ * struct rpc_hdr of each request, and answers with a frame.
+ *
+ */
+
+#ifndef _ECHO_FRAME_H
+#define _ECHO_FRAME_H
+
+#include <stdint.h>
+
+/* All fields are in network byte order. */
+struct frame_hdr {
+	uint32_t	len;	/* Whole frame, header included. */
+	uint32_t	id;	/* Request id, sequential per connection. */
+	uint64_t	ts;	/* Time of send, see now_ns(). */
+} __attribute__((packed));
+
+/* Header of the requests of eserv -m rpc. @frame.len is the size of the
+ * request. The response is a frame of @resp_len bytes, whose header
+ * carries the @id and @ts of the request, followed by the character
+ * generator pattern.
+ */
+struct rpc_hdr {
+	struct frame_hdr	frame;
+	uint32_t		resp_len;
+} __attribute__((packed));
+
+struct hist;
+
+/* Counters of a pipelined run. */
+struct pipeline_result {
+	unsigned long	sent;
+	unsigned long	received;
+	unsigned long	out_of_order;
+	unsigned long	bytes;
+	unsigned long	elapsed_ns;
+};
+
+/* Send @count frames of @size bytes over the connected stream socket @s,
+ * keeping up to @depth frames in flight, and record in @h the latency of
+ * each frame from right before it is sent until its echo is fully
+ * received. If @resp_size isn't 0, frames are requests for eserv -m rpc
+ * that ask for responses of @resp_size bytes instead of echoes.
+ * If @deadline isn't 0, no frame is sent after that time (see now_ns()),
+ * and only the echoes in flight are waited for, for up to a second.
+ * Return 0 on success, and -1 if the connection fails before all echoes
+ * are received, or they do not all arrive in that second.
+ */
+int stream_pipeline(int s, unsigned long count, int size, int resp_size,
+	int depth, unsigned long deadline, struct hist *h,
+	struct pipeline_result *res);
+
+#endif /* _ECHO_FRAME_H */
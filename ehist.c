@@ -0,0 +1,77 @@
+/*
+ * ehist.c
+ *
+ * This file implements the log-bucketed histograms of the echo server and
+ * clients.
+ *
+ */
+
+#include <string.h>
+#include "ehist.h"
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0UL;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/**
+ * bucket_top(): Return the largest value that falls in bucket @i.
+ */
+static unsigned long bucket_top(int i)
+{
+	int e, sub;
+
+	if (i < HIST_SUB)
+		return i;
+	e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	sub = i % HIST_SUB;
+	return (1UL << e) + ((unsigned long)(sub + 1) << (e - HIST_SUB_BITS))
+		- 1;
+}
+
+unsigned long hist_percentile(const struct hist *h, double p)
+{
+	unsigned long rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+	rank = (unsigned long)(p / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+	}
+	return h->max;
+}
+
+void hist_print(FILE *f, const char *name, const struct hist *h)
+{
+	if (!h->count) {
+		fprintf(f, "%s: no samples\n", name);
+		return;
+	}
+	fprintf(f, "%s: n=%lu min=%.1fus mean=%.1fus p50=%.1fus p90=%.1fus "
+		"p99=%.1fus p99.9=%.1fus max=%.1fus\n", name, h->count,
+		h->min / 1e3, (double)h->sum / h->count / 1e3,
+		hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+		hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+		h->max / 1e3);
+}
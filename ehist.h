@@ -0,0 +1,61 @@
+/*
+ * ehist.h
+ *
+ * A header file for the log-bucketed histograms of the echo server and
+ * clients.
+ *
+ */
+
+#ifndef _ECHO_HIST_H
+#define _ECHO_HIST_H
+
+#include <stdio.h>
+
+/* Each power of 2 is split into 2^HIST_SUB_BITS linear buckets, so the
+ * relative error of any recorded value is below 1/2^HIST_SUB_BITS.
+ */
+#define HIST_SUB_BITS	4
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	unsigned long	count;
+	unsigned long	sum;
+	unsigned long	min;
+	unsigned long	max;
+	unsigned long	buckets[HIST_BUCKETS];
+};
+
+void hist_init(struct hist *h);
+
+static inline int hist_bucket(unsigned long v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzl(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static inline void hist_add(struct hist *h, unsigned long v)
+{
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[hist_bucket(v)]++;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/* Return an upper bound of the @p-th percentile, 0 <= @p <= 100. */
+unsigned long hist_percentile(const struct hist *h, double p);
+
+/* Print a one-line summary of @h, whose values are nanoseconds. */
+void hist_print(FILE *f, const char *name, const struct hist *h);
+
+#endif /* _ECHO_HIST_H */
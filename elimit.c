@@ -0,0 +1,199 @@
+/*
+ * elimit.c
+ *
+ * This file implements the per-source rate limiter of the echo server.
+ *
+ * Buckets refill lazily: a source's buckets are only brought up to date
+ * when that source sends a message. Nothing runs per tick, and idle
+ * sources cost nothing but their slot.
+ *
+ * Slots are freed with backward-shift deletion instead of tombstones,
+ * so probe sequences stay short however many sources get evicted.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eutils.h"
+#include "elimit.h"
+
+#define NS_PER_SEC	1000000000UL
+
+static inline uint32_t lru_head(const struct rate_limit *l)
+{
+	return l->mask + 1;
+}
+
+static inline void lru_del(struct rate_limit *l, uint32_t i)
+{
+	struct limit_entry *t = l->table;
+
+	t[t[i].lru_prev].lru_next = t[i].lru_next;
+	t[t[i].lru_next].lru_prev = t[i].lru_prev;
+}
+
+static inline void lru_add(struct rate_limit *l, uint32_t i)
+{
+	struct limit_entry *t = l->table;
+	uint32_t head = lru_head(l);
+
+	t[i].lru_prev = head;
+	t[i].lru_next = t[head].lru_next;
+	t[t[head].lru_next].lru_prev = i;
+	t[head].lru_next = i;
+}
+
+void limit_init(struct rate_limit *l, unsigned int sources)
+{
+	uint32_t slots = 16;
+
+	assert(sources > 0 && sources <= (1U << 30));
+	while (slots / 4 * 3 < sources)
+		slots <<= 1;
+
+	memset(l, 0, sizeof(*l));
+	/* One more slot for the head of the LRU list. */
+	l->table = calloc(slots + 1, sizeof(*l->table));
+	assert(l->table);
+	l->mask = slots - 1;
+	l->max_count = sources;
+	l->table[slots].lru_prev = l->table[slots].lru_next = slots;
+}
+
+void limit_set(struct rate_limit *l, enum limit_bucket bucket,
+	uint64_t rate, uint64_t burst)
+{
+	assert(bucket < LIMIT_BUCKETS);
+	assert(!rate || (burst > 0 && burst <= LIMIT_MAX_BURST));
+	l->rate[bucket] = rate;
+	l->burst[bucket] = burst * NS_PER_SEC;
+	l->fill_ns[bucket] = rate ? burst * NS_PER_SEC / rate : 0;
+}
+
+/**
+ * evict(): Free slot @i, moving back the entries after it that would
+ * otherwise become unreachable.
+ */
+static void evict(struct rate_limit *l, uint32_t i)
+{
+	struct limit_entry *t = l->table;
+	uint32_t j = i;
+
+	lru_del(l, i);
+	while (1) {
+		uint32_t home;
+
+		j = (j + 1) & l->mask;
+		if (!t[j].key)
+			break;
+		home = t[j].key & l->mask;
+		/* An entry can move back to @i if @i lies between its home
+		 * slot and its slot @j, cyclically.
+		 */
+		if (((j - home) & l->mask) < ((j - i) & l->mask))
+			continue;
+		t[i] = t[j];
+		t[t[i].lru_prev].lru_next = i;
+		t[t[i].lru_next].lru_prev = i;
+		i = j;
+	}
+	t[i].key = 0;
+	l->count--;
+}
+
+/**
+ * lookup(): Return the slot of @key, inserting it with full buckets if
+ * it is not in the table.
+ */
+static uint32_t lookup(struct rate_limit *l, uint64_t key,
+	unsigned long now_ns)
+{
+	struct limit_entry *t = l->table;
+	uint32_t i = key & l->mask;
+	int b;
+
+	for (; t[i].key; i = (i + 1) & l->mask) {
+		if (t[i].key == key) {
+			lru_del(l, i);
+			lru_add(l, i);
+			return i;
+		}
+	}
+
+	if (l->count >= l->max_count) {
+		evict(l, t[lru_head(l)].lru_prev);
+		l->evictions++;
+		/* Eviction may have moved entries into the probe sequence
+		 * of @key, look for its free slot again.
+		 */
+		for (i = key & l->mask; t[i].key; i = (i + 1) & l->mask)
+			;
+	}
+
+	t[i].key = key;
+	t[i].last_ns = now_ns;
+	for (b = 0; b < LIMIT_BUCKETS; b++)
+		t[i].tokens[b] = l->burst[b];
+	lru_add(l, i);
+	l->count++;
+	return i;
+}
+
+enum limit_verdict limit_check(struct rate_limit *l,
+	const struct sockaddr *addr, socklen_t len, unsigned int bytes,
+	unsigned long now_ns)
+{
+	const uint64_t cost[LIMIT_BUCKETS] = {
+		[LIMIT_MSGS]	= NS_PER_SEC,
+		[LIMIT_BYTES]	= (uint64_t)bytes * NS_PER_SEC,
+	};
+	enum limit_verdict v = LIMIT_PASS;
+	struct limit_entry *e;
+	uint64_t elapsed;
+	int b;
+
+	if (l->rate[LIMIT_BYTES] &&
+		cost[LIMIT_BYTES] > l->burst[LIMIT_BYTES]) {
+		v = LIMIT_DROP_OVERSIZE;
+		goto out;
+	}
+
+	e = &l->table[lookup(l, addr_hash(addr, len, 0), now_ns)];
+	elapsed = now_ns > e->last_ns ? now_ns - e->last_ns : 0;
+	e->last_ns = now_ns;
+	for (b = 0; b < LIMIT_BUCKETS; b++) {
+		if (!l->rate[b])
+			continue;
+		/* Capping @elapsed first keeps the product from
+		 * overflowing.
+		 */
+		if (elapsed >= l->fill_ns[b] ||
+			e->tokens[b] + elapsed * l->rate[b] > l->burst[b])
+			e->tokens[b] = l->burst[b];
+		else
+			e->tokens[b] += elapsed * l->rate[b];
+		if (v == LIMIT_PASS && e->tokens[b] < cost[b])
+			v = b == LIMIT_MSGS ? LIMIT_DROP_MSGS :
+				LIMIT_DROP_BYTES;
+	}
+	if (v == LIMIT_PASS)
+		for (b = 0; b < LIMIT_BUCKETS; b++)
+			if (l->rate[b])
+				e->tokens[b] -= cost[b];
+
+out:
+	l->verdicts[v]++;
+	return v;
+}
+
+void limit_report(FILE *f, void *arg)
+{
+	struct rate_limit *l = arg;
+
+	fprintf(f, "rate limit: %lu passed, dropped %lu over message rate, "
+		"%lu over byte rate, %lu oversize; %u sources, "
+		"%lu evictions\n", l->verdicts[LIMIT_PASS],
+		l->verdicts[LIMIT_DROP_MSGS], l->verdicts[LIMIT_DROP_BYTES],
+		l->verdicts[LIMIT_DROP_OVERSIZE], l->count, l->evictions);
+}
@@ -0,0 +1,93 @@
+/*
+ * elimit.h
+ *
+ * A header file for the per-source rate limiter of the echo server.
+ *
+ */
+
+#ifndef _ECHO_LIMIT_H
+#define _ECHO_LIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* The buckets of a source. A rate of 0 disables a bucket. */
+enum limit_bucket {
+	LIMIT_MSGS,		/* Messages per second. */
+	LIMIT_BYTES,		/* Bytes per second. */
+	LIMIT_BUCKETS,
+};
+
+/* What limit_check() decides. */
+enum limit_verdict {
+	LIMIT_PASS,
+	LIMIT_DROP_MSGS,	/* Out of message tokens. */
+	LIMIT_DROP_BYTES,	/* Out of byte tokens. */
+	/* Larger than the byte burst, so it never passes. */
+	LIMIT_DROP_OVERSIZE,
+	LIMIT_VERDICTS,
+};
+
+/* A slot of the table. Tokens are scaled by 10^9, so that refilling for
+ * an interval in nanoseconds is a single multiplication.
+ */
+struct limit_entry {
+	uint64_t	key;		/* Hash of the source, 0 if free. */
+	uint64_t	last_ns;	/* Time of the last refill. */
+	uint64_t	tokens[LIMIT_BUCKETS];
+	uint32_t	lru_prev;	/* Slots, see struct rate_limit. */
+	uint32_t	lru_next;
+};
+
+/* Token buckets of the sources, in an open-addressing table with linear
+ * probing. The table has a fixed number of slots, the smallest power of 2
+ * that keeps it at most 3/4 full, so between 3/8 and 3/4 full once it
+ * holds @max_count sources; from then on, each new source evicts the
+ * least recently seen one, whose buckets start full again if it comes
+ * back. Slot @mask + 1 is the head of the LRU
+ * list, the most recently seen source comes first.
+ *
+ * Sources are told apart by a 64-bit hash of their address, two sources
+ * whose hashes collide share buckets.
+ */
+struct rate_limit {
+	struct limit_entry	*table;
+	uint32_t		mask;
+	uint32_t		count;
+	uint32_t		max_count;
+	uint64_t		rate[LIMIT_BUCKETS];
+	uint64_t		burst[LIMIT_BUCKETS];	/* Scaled. */
+	/* Time to refill from empty to full. */
+	uint64_t		fill_ns[LIMIT_BUCKETS];
+	unsigned long		verdicts[LIMIT_VERDICTS];
+	unsigned long		evictions;
+};
+
+/* Track up to @sources sources. All buckets start disabled. */
+void limit_init(struct rate_limit *l, unsigned int sources);
+
+/* Tokens are scaled by 10^9, and refilling may briefly take a bucket to
+ * twice its burst, so this is the largest burst that fits.
+ */
+#define LIMIT_MAX_BURST	(UINT64_MAX / 1000000000UL / 2)
+
+/* Refill @bucket at @rate tokens per second, up to @burst tokens, which
+ * is at most LIMIT_MAX_BURST.
+ */
+void limit_set(struct rate_limit *l, enum limit_bucket bucket,
+	uint64_t rate, uint64_t burst);
+
+/* Charge a message of @bytes bytes from @addr at @now_ns, see now_ns(),
+ * to the buckets of the source of @addr. Only the address counts for
+ * IPv4 and IPv6, so that all ports of a host share buckets. A message
+ * that is dropped takes no tokens. O(1) on average.
+ */
+enum limit_verdict limit_check(struct rate_limit *l,
+	const struct sockaddr *addr, socklen_t len, unsigned int bytes,
+	unsigned long now_ns);
+
+/* Print the verdicts and evictions of the struct rate_limit @arg. */
+void limit_report(FILE *f, void *arg);
+
+#endif /* _ECHO_LIMIT_H */
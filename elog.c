@@ -0,0 +1,183 @@
+/*
+ * elog.c
+ *
+ * This file implements an asynchronous logger. Every thread that logs owns
+ * a single-producer single-consumer ring of fixed-size binary records.
+ * A background thread drains the rings, formats the records, and writes
+ * them out, so the hot paths never format text nor block on a slow
+ * terminal or pipe.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "eutils.h"
+#include "elog.h"
+
+/* Must be a power of 2. */
+#define RING_SIZE	1024
+#define CACHE_LINE	64
+
+/* Time the background thread sleeps when all rings are empty. */
+#define IDLE_NS		(1000 * 1000)
+
+struct record {
+	int	event;
+	int	fd;
+	long	a;
+	long	b;
+};
+
+struct ring {
+	/* Written by the producer, read by the consumer. */
+	_Atomic unsigned int	head __attribute__((aligned(CACHE_LINE)));
+	/* Written by the consumer, read by the producer. */
+	_Atomic unsigned int	tail __attribute__((aligned(CACHE_LINE)));
+	_Atomic unsigned long	dropped;
+
+	struct ring		*next;
+	struct record		records[RING_SIZE];
+};
+
+static const char * const formats[ELOG_MAX] = {
+	[ELOG_CONNECT]	= "---- Connect()\n",
+	[ELOG_CLOSE]	= "---- Close()\n",
+};
+
+static __thread struct ring *my_ring;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings;
+
+static FILE *log_out;
+static pthread_t writer;
+static _Atomic int running;
+
+/**
+ * new_ring(): Allocate the ring of the calling thread and make it
+ * visible to the background thread.
+ */
+static struct ring *new_ring(void)
+{
+	struct ring *r;
+
+	assert(!posix_memalign((void **)&r, CACHE_LINE, sizeof(*r)));
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->dropped, 0);
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	return r;
+}
+
+void elog(enum elog_event event, int fd, long a, long b)
+{
+	struct ring *r = my_ring;
+	unsigned int head, tail;
+	struct record *rec;
+
+	if (!running)
+		return;
+	if (!r)
+		r = my_ring = new_ring();
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail >= RING_SIZE) {
+		atomic_fetch_add_explicit(&r->dropped, 1,
+			memory_order_relaxed);
+		return;
+	}
+
+	rec = &r->records[head & (RING_SIZE - 1)];
+	rec->event = event;
+	rec->fd = fd;
+	rec->a = a;
+	rec->b = b;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/**
+ * drain_ring(): Format every record available in @r.
+ * Return the number of records written out.
+ */
+static int drain_ring(struct ring *r)
+{
+	unsigned int head, tail;
+	int count = 0;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	while (tail != head) {
+		struct record *rec = &r->records[tail & (RING_SIZE - 1)];
+		assert(rec->event >= 0 && rec->event < ELOG_MAX);
+		fprintf(log_out, formats[rec->event], rec->fd, rec->a, rec->b);
+		tail++;
+		count++;
+	}
+	atomic_store_explicit(&r->tail, tail, memory_order_release);
+	return count;
+}
+
+static int drain_all(unsigned long *preported)
+{
+	unsigned long dropped = 0;
+	struct ring *r;
+	int count = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (r = rings; r; r = r->next) {
+		count += drain_ring(r);
+		dropped += atomic_load_explicit(&r->dropped,
+			memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	if (dropped != *preported) {
+		fprintf(log_out, "---- elog: %lu records dropped\n",
+			dropped - *preported);
+		*preported = dropped;
+	}
+	if (count)
+		fflush(log_out);
+	return count;
+}
+
+static void *writer_main(void *arg)
+{
+	const struct timespec idle = {.tv_sec = 0, .tv_nsec = IDLE_NS};
+	unsigned long reported = 0;
+
+	UNUSED(arg);
+	while (atomic_load(&running))
+		if (!drain_all(&reported))
+			nanosleep(&idle, NULL);
+
+	/* Records queued while stopping. */
+	drain_all(&reported);
+	fflush(log_out);
+	return NULL;
+}
+
+void elog_init(FILE *out)
+{
+	assert(!running);
+	log_out = out;
+	atomic_store(&running, 1);
+	assert(!pthread_create(&writer, NULL, writer_main, NULL));
+	assert(!atexit(elog_exit));
+}
+
+void elog_exit(void)
+{
+	if (!atomic_exchange(&running, 0))
+		return;
+	assert(!pthread_join(writer, NULL));
+}
@@ -0,0 +1,35 @@
+/*
+ * elog.h
+ *
+ * A header file for the asynchronous logger that keeps formatting and
+ * blocking writes off the hot paths of the echo server and clients.
+ *
+ */
+
+#ifndef _ECHO_LOG_H
+#define _ECHO_LOG_H
+
+#include <stdio.h>
+
+/* Events that can be logged. Each one has a format string in elog.c. */
+enum elog_event {
+	ELOG_CONNECT,
+	ELOG_CLOSE,
+
+	ELOG_MAX
+};
+
+/* Start the background thread that writes records out to @out. */
+void elog_init(FILE *out);
+
+/* Queue a record in the ring of the calling thread. This never blocks;
+ * if the ring is full, the record is dropped and counted.
+ */
+void elog(enum elog_event event, int fd, long a, long b);
+
+/* Drain all rings and stop the background thread. It is registered with
+ * atexit() by elog_init(), so calling it is only needed for an early stop.
+ */
+void elog_exit(void);
+
+#endif /* _ECHO_LOG_H */
@@ -0,0 +1,375 @@
+/*
+ * epacket.c
+ *
+ * This file implements the AF_PACKET engine of the datagram echo server.
+ *
+ * A packet socket bound to an interface shares two rings with the kernel.
+ * The receive ring is TPACKET_V3, so the kernel fills whole blocks with
+ * the frames that arrive, and hands over a block once it is full or
+ * RX_BLOCK_TOV_MS passes. The frames that carry a datagram to the echo
+ * port are reflected by swapping their headers, and copied to the
+ * transmit ring, which goes out with a single send() per block.
+ * No socket buffer, routing decision, or copy to a user buffer is involved.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include "eutils.h"
+#include "ehist.h"
+#include "epacket.h"
+
+#define RX_BLOCK_SIZE	(1 << 20)
+#define RX_BLOCKS	64
+#define RX_FRAME_SIZE	2048
+/* Longest a frame waits in a block that is not full. */
+#define RX_BLOCK_TOV_MS	1
+
+/* Each transmit frame is a block of its own, sized for the MTU. */
+#define TX_FRAMES	128
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING	23
+#endif
+
+struct packet_ring {
+	int		fd;
+	char		*rx;
+	char		*tx;
+	unsigned int	rx_block;	/* Next block to read. */
+	unsigned int	tx_frame;	/* Next frame to fill. */
+	unsigned int	tx_frame_size;
+	unsigned int	tx_queued;	/* Filled since send(). */
+};
+
+static int packet_fd = -1;
+static _Atomic unsigned long reflected, ignored, blocks, kicks, tx_waits;
+/* Only the reporting thread reads the kernel counters, which reset on
+ * each read.
+ */
+static unsigned long kernel_packets, kernel_drops, kernel_freezes;
+
+int udp_reflect(void *pkt, unsigned int len, uint16_t port,
+	int csum_partial)
+{
+	struct ethhdr *eth = pkt;
+	struct iphdr *ip = (struct iphdr *)(eth + 1);
+	struct udphdr *udp;
+	unsigned char mac[ETH_ALEN];
+	char *end = (char *)pkt + len;
+	uint32_t addr;
+	uint16_t p;
+
+	if (len < sizeof(*eth) + sizeof(*ip) + sizeof(*udp) ||
+		eth->h_proto != htons(ETH_P_IP) || ip->version != 4 ||
+		ip->ihl < 5 || ip->protocol != IPPROTO_UDP ||
+		/* Fragments. */
+		(ip->frag_off & htons(IP_MF | IP_OFFMASK)))
+		return -1;
+	udp = (struct udphdr *)((char *)ip + ip->ihl * 4);
+	if ((char *)(udp + 1) > end || udp->dest != port)
+		return -1;
+	/* The payload ends where the first of the frame, the IP datagram and
+	 * the UDP datagram does, since their lengths come from the wire.
+	 */
+	if ((char *)ip + ntohs(ip->tot_len) < end)
+		end = (char *)ip + ntohs(ip->tot_len);
+	if ((char *)udp + ntohs(udp->len) < end)
+		end = (char *)udp + ntohs(udp->len);
+	if ((char *)(udp + 1) > end)
+		return -1;
+
+	memcpy(mac, eth->h_dest, ETH_ALEN);
+	memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, mac, ETH_ALEN);
+	addr = ip->saddr;
+	ip->saddr = ip->daddr;
+	ip->daddr = addr;
+	p = udp->source;
+	udp->source = udp->dest;
+	udp->dest = p;
+	if (csum_partial)
+		udp->check = 0;
+	return end - (char *)(udp + 1);
+}
+
+/**
+ * tx_frame_size(): Return the size of the transmit frames, so that a frame
+ * of the MTU of @ifname fits in them.
+ */
+static unsigned int tx_frame_size(int fd, const char *ifname)
+{
+	unsigned int need, size = 4096;
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	assert(!ioctl(fd, SIOCGIFMTU, &ifr));
+	need = TPACKET3_HDRLEN + ETH_HLEN + ifr.ifr_mtu;
+	while (size < need)
+		size <<= 1;
+	return size;
+}
+
+/**
+ * packet_open(): Set the rings up on @ifname. Return 0 on success.
+ */
+static int packet_open(struct packet_ring *r, const char *ifname)
+{
+	struct tpacket_req3 rx, tx;
+	struct sockaddr_ll sll;
+	int one = 1, version = TPACKET_V3;
+	size_t rx_len, tx_len;
+	char *map;
+
+	memset(r, 0, sizeof(*r));
+	/* No protocol until bind(), so nothing queues before the rings. */
+	r->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (r->fd < 0) {
+		fprintf(stderr, "%s: socket errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_ifindex = if_nametoindex(ifname);
+	if (!sll.sll_ifindex) {
+		fprintf(stderr, "%s: no interface %s\n", __func__, ifname);
+		goto close;
+	}
+
+	assert(!setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version,
+		sizeof(version)));
+	/* Malformed transmit frames are skipped rather than stall the
+	 * ring, and echoes skip the qdisc.
+	 */
+	assert(!setsockopt(r->fd, SOL_PACKET, PACKET_LOSS, &one,
+		sizeof(one)));
+	setsockopt(r->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+	/* Since Linux 4.20, the echoes do not come back to the receive
+	 * ring. Otherwise, the loop ignores them.
+	 */
+	setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+		sizeof(one));
+
+	memset(&rx, 0, sizeof(rx));
+	rx.tp_block_size = RX_BLOCK_SIZE;
+	rx.tp_block_nr = RX_BLOCKS;
+	rx.tp_frame_size = RX_FRAME_SIZE;
+	rx.tp_frame_nr = RX_BLOCK_SIZE / RX_FRAME_SIZE * RX_BLOCKS;
+	rx.tp_retire_blk_tov = RX_BLOCK_TOV_MS;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx))) {
+		fprintf(stderr, "%s: PACKET_RX_RING errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		goto close;
+	}
+
+	r->tx_frame_size = tx_frame_size(r->fd, ifname);
+	memset(&tx, 0, sizeof(tx));
+	tx.tp_block_size = r->tx_frame_size;
+	tx.tp_block_nr = TX_FRAMES;
+	tx.tp_frame_size = r->tx_frame_size;
+	tx.tp_frame_nr = TX_FRAMES;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx))) {
+		/* A TPACKET_V3 transmit ring requires Linux 4.11. */
+		fprintf(stderr, "%s: PACKET_TX_RING errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		goto close;
+	}
+
+	/* The transmit ring follows the receive ring. */
+	rx_len = (size_t)RX_BLOCK_SIZE * RX_BLOCKS;
+	tx_len = (size_t)r->tx_frame_size * TX_FRAMES;
+	map = mmap(NULL, rx_len + tx_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, 0);
+	assert(map != MAP_FAILED);
+	r->rx = map;
+	r->tx = map + rx_len;
+
+	if (bind(r->fd, (struct sockaddr *)&sll, sizeof(sll))) {
+		fprintf(stderr, "%s: bind errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		assert(!munmap(map, rx_len + tx_len));
+		goto close;
+	}
+	return 0;
+
+close:
+	assert(!close(r->fd));
+	return -1;
+}
+
+/**
+ * kick(): Have the kernel send the frames filled so far. If @wait is true,
+ * block until it has.
+ */
+static void kick(struct packet_ring *r, int wait)
+{
+	if (!r->tx_queued && !wait)
+		return;
+	if (send(r->fd, NULL, 0, wait ? 0 : MSG_DONTWAIT) < 0)
+		assert(errno == EAGAIN || errno == ENOBUFS ||
+			errno == EINTR);
+	r->tx_queued = 0;
+	atomic_fetch_add_explicit(&kicks, 1, memory_order_relaxed);
+}
+
+/**
+ * tx_frame(): Return the next free transmit frame, waiting for the kernel
+ * to send frames if there is none.
+ */
+static struct tpacket3_hdr *tx_frame(struct packet_ring *r)
+{
+	struct tpacket3_hdr *th = (struct tpacket3_hdr *)
+		(r->tx + r->tx_frame * r->tx_frame_size);
+
+	while (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) !=
+		TP_STATUS_AVAILABLE) {
+		struct pollfd pfd = {.fd = r->fd, .events = POLLOUT};
+
+		atomic_fetch_add_explicit(&tx_waits, 1, memory_order_relaxed);
+		kick(r, 1);
+		if (__atomic_load_n(&th->tp_status, __ATOMIC_ACQUIRE) ==
+			TP_STATUS_AVAILABLE)
+			break;
+		assert(poll(&pfd, 1, -1) >= 0 || errno == EINTR);
+	}
+	r->tx_frame = (r->tx_frame + 1) % TX_FRAMES;
+	return th;
+}
+
+/**
+ * echo_frame(): Queue the echo of the received frame @h, if it has one.
+ * Return the length of the payload echoed, or -1.
+ */
+static int echo_frame(struct packet_ring *r, struct tpacket3_hdr *h,
+	uint16_t port)
+{
+	struct sockaddr_ll *sll = (struct sockaddr_ll *)
+		((char *)h + TPACKET_ALIGN(sizeof(*h)));
+	char *pkt = (char *)h + h->tp_mac;
+	struct tpacket3_hdr *th;
+	int len;
+
+	if (sll->sll_pkttype == PACKET_OUTGOING || h->tp_snaplen < h->tp_len ||
+		h->tp_snaplen > r->tx_frame_size - TPACKET3_HDRLEN)
+		return -1;
+	/* Reflect in the receive ring, the block is ours until released. */
+	len = udp_reflect(pkt, h->tp_snaplen, port,
+		h->tp_status & TP_STATUS_CSUMNOTREADY);
+	if (len < 0)
+		return -1;
+
+	th = tx_frame(r);
+	memcpy((char *)th + TPACKET3_HDRLEN - sizeof(struct sockaddr_ll), pkt,
+		h->tp_snaplen);
+	th->tp_len = h->tp_snaplen;
+	th->tp_snaplen = h->tp_snaplen;
+	th->tp_next_offset = 0;
+	__atomic_store_n(&th->tp_status, TP_STATUS_SEND_REQUEST,
+		__ATOMIC_RELEASE);
+	r->tx_queued++;
+	return len;
+}
+
+/**
+ * echo_block(): Echo the frames of block @bd, and give it back to the
+ * kernel. The turnaround of each datagram runs from its timestamp, taken
+ * by the kernel on reception, until its echo is handed to the kernel.
+ */
+static void echo_block(struct packet_ring *r, struct tpacket_block_desc *bd,
+	uint16_t port, struct hist *turnaround, unsigned long *bytes)
+{
+	struct tpacket3_hdr *h = (struct tpacket3_hdr *)
+		((char *)bd + bd->hdr.bh1.offset_to_first_pkt);
+	/* Frames are at least TPACKET_ALIGNMENT apart. */
+	static unsigned long stamps[RX_BLOCK_SIZE / TPACKET_ALIGNMENT];
+	unsigned int i, n = 0;
+	struct timespec now;
+
+	for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+		int len = echo_frame(r, h, port);
+
+		if (len >= 0) {
+			stamps[n++] = h->tp_sec * 1000000000UL + h->tp_nsec;
+			*bytes += len;
+		}
+		h = (struct tpacket3_hdr *)((char *)h + h->tp_next_offset);
+	}
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+		__ATOMIC_RELEASE);
+	kick(r, 0);
+
+	/* The kernel stamps frames with the real-time clock. */
+	assert(!clock_gettime(CLOCK_REALTIME, &now));
+	for (i = 0; i < n; i++)
+		hist_add(turnaround, now.tv_sec * 1000000000UL + now.tv_nsec -
+			stamps[i]);
+	atomic_fetch_add_explicit(&reflected, n, memory_order_relaxed);
+	atomic_fetch_add_explicit(&ignored, bd->hdr.bh1.num_pkts - n,
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&blocks, 1, memory_order_relaxed);
+}
+
+int packet_datagram_loop(const char *ifname, uint16_t port,
+	struct hist *turnaround, unsigned long *bytes)
+{
+	struct packet_ring r;
+
+	if (packet_open(&r, ifname))
+		return -1;
+	packet_fd = r.fd;
+
+	while (1) {
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+			(r.rx + r.rx_block * RX_BLOCK_SIZE);
+
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+			__ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+			struct pollfd pfd = {.fd = r.fd,
+				.events = POLLIN | POLLERR};
+
+			assert(poll(&pfd, 1, -1) >= 0 || errno == EINTR);
+			continue;
+		}
+		echo_block(&r, bd, port, turnaround, bytes);
+		r.rx_block = (r.rx_block + 1) % RX_BLOCKS;
+	}
+}
+
+void packet_report(FILE *f, void *arg)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	UNUSED(arg);
+	if (packet_fd >= 0 && !getsockopt(packet_fd, SOL_PACKET,
+		PACKET_STATISTICS, &st, &len)) {
+		kernel_packets += st.tp_packets;
+		kernel_drops += st.tp_drops;
+		kernel_freezes += st.tp_freeze_q_cnt;
+	}
+	fprintf(f, "packet rings: %lu datagrams reflected, %lu frames "
+		"ignored, %lu blocks, %lu sends, %lu waits for a transmit "
+		"frame; kernel: %lu frames, %lu dropped, %lu ring full\n",
+		atomic_load(&reflected), atomic_load(&ignored),
+		atomic_load(&blocks), atomic_load(&kicks),
+		atomic_load(&tx_waits), kernel_packets, kernel_drops,
+		kernel_freezes);
+}
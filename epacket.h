@@ -0,0 +1,41 @@
+/*
+ * epacket.h
+ *
+ * A header file for the AF_PACKET engine of the datagram echo server.
+ *
+ */
+
+#ifndef _ECHO_PACKET_H
+#define _ECHO_PACKET_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct hist;
+
+/* Turn the Ethernet frame @pkt of @len bytes into its own echo if it is an
+ * IPv4 UDP datagram to port @port, in network byte order, by swapping the
+ * addresses and ports of its headers in place. Swapping leaves the IP and
+ * UDP checksums valid. If @csum_partial is true, the kernel has not
+ * computed the UDP checksum yet, so it is cleared, which IPv4 allows.
+ * Return the length of the UDP payload, cut to what the frame and the IP
+ * header hold, or -1 if @pkt is not such a datagram and was left alone.
+ */
+int udp_reflect(void *pkt, unsigned int len, uint16_t port,
+	int csum_partial);
+
+/* Echo the datagrams to @port, in network byte order, that arrive at
+ * interface @ifname, reading them from a TPACKET_V3 receive ring and
+ * writing the echoes to a transmit ring, both shared with the kernel.
+ * The socket layer never sees the datagrams, but a socket should be bound
+ * to @port so that the stack does not answer with ICMP errors.
+ * Times and bytes go to @turnaround and *@bytes as in the classic loop.
+ * This only returns if the rings cannot be set up, and then returns -1.
+ */
+int packet_datagram_loop(const char *ifname, uint16_t port,
+	struct hist *turnaround, unsigned long *bytes);
+
+/* Print the counters of the rings. */
+void packet_report(FILE *f, void *arg);
+
+#endif /* _ECHO_PACKET_H */
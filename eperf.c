@@ -0,0 +1,142 @@
+/*
+ * eperf.c
+ *
+ * This file implements the per-thread performance counters of the echo
+ * server and clients on top of perf_event_open(2).
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "eperf.h"
+
+#define NOT_AVAILABLE (~0UL)
+
+static const struct {
+	const char	*name;
+	__u32		type;
+	__u64		config;
+} events[PERF_MAX] = {
+	[PERF_TASK_CLOCK]	= {"task_clock_ns", PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_TASK_CLOCK},
+	[PERF_CYCLES]		= {"cycles", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CPU_CYCLES},
+	[PERF_INSTRUCTIONS]	= {"instructions", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_INSTRUCTIONS},
+	[PERF_CACHE_MISSES]	= {"cache_misses", PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CACHE_MISSES},
+	[PERF_CTX_SWITCHES]	= {"context_switches", PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_CONTEXT_SWITCHES},
+	[PERF_PAGE_FAULTS]	= {"page_faults", PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+int perf_open(struct perf_counters *pc)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_hv = 1;
+
+		/* Calling thread, any CPU. */
+		pc->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+			PERF_FLAG_FD_CLOEXEC);
+		if (pc->fds[i] >= 0)
+			n++;
+	}
+	return n;
+}
+
+void perf_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_MAX; i++)
+		if (pc->fds[i] >= 0) {
+			assert(!close(pc->fds[i]));
+			pc->fds[i] = -1;
+		}
+}
+
+void perf_read(const struct perf_counters *pc, struct perf_values *pv)
+{
+	int i;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		/* Value, time enabled, and time running. */
+		__u64 buf[3];
+
+		pv->val[i] = NOT_AVAILABLE;
+		if (pc->fds[i] < 0 ||
+			read(pc->fds[i], buf, sizeof(buf)) != sizeof(buf))
+			continue;
+		/* Never scheduled on the PMU, so the count means nothing. */
+		if (!buf[2])
+			continue;
+		if (buf[2] < buf[1])
+			buf[0] = (double)buf[0] * buf[1] / buf[2];
+		pv->val[i] = buf[0];
+	}
+}
+
+void perf_add(struct perf_values *dst, const struct perf_values *src)
+{
+	int i;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		if (src->val[i] == NOT_AVAILABLE)
+			dst->val[i] = NOT_AVAILABLE;
+		else if (dst->val[i] != NOT_AVAILABLE)
+			dst->val[i] += src->val[i];
+	}
+}
+
+void perf_print(FILE *f, const char *name, const struct perf_values *pv,
+	unsigned long msgs, unsigned long bytes)
+{
+	int i;
+
+	fprintf(f, "%s: msgs=%lu bytes=%lu\n", name, msgs, bytes);
+	for (i = 0; i < PERF_MAX; i++) {
+		if (pv->val[i] == NOT_AVAILABLE) {
+			fprintf(f, "\t%-16s n/a\n", events[i].name);
+			continue;
+		}
+		fprintf(f, "\t%-16s %lu (%.1f/msg, %.3f/byte)\n",
+			events[i].name, pv->val[i],
+			msgs ? (double)pv->val[i] / msgs : 0.0,
+			bytes ? (double)pv->val[i] / bytes : 0.0);
+	}
+}
+
+void perf_print_json(FILE *f, const struct perf_values *pv,
+	unsigned long msgs, unsigned long bytes)
+{
+	int i;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		if (i)
+			fprintf(f, ", ");
+		if (pv->val[i] == NOT_AVAILABLE) {
+			fprintf(f, "\"%s_per_msg\": null, "
+				"\"%s_per_byte\": null", events[i].name,
+				events[i].name);
+			continue;
+		}
+		fprintf(f, "\"%s_per_msg\": %.3f, \"%s_per_byte\": %.5f",
+			events[i].name, msgs ? (double)pv->val[i] / msgs : 0.0,
+			events[i].name,
+			bytes ? (double)pv->val[i] / bytes : 0.0);
+	}
+}
@@ -0,0 +1,61 @@
+/*
+ * eperf.h
+ *
+ * A header file for the per-thread performance counters of the echo server
+ * and clients.
+ *
+ */
+
+#ifndef _ECHO_PERF_H
+#define _ECHO_PERF_H
+
+#include <stdio.h>
+
+enum perf_counter {
+	PERF_TASK_CLOCK,
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_CTX_SWITCHES,
+	PERF_PAGE_FAULTS,
+
+	PERF_MAX
+};
+
+/* Counters of a single thread. A counter that is not available,
+ * for example, hardware counters inside some virtual machines,
+ * has a negative file descriptor.
+ */
+struct perf_counters {
+	int	fds[PERF_MAX];
+};
+
+struct perf_values {
+	/* ~0UL when the counter is not available. */
+	unsigned long	val[PERF_MAX];
+};
+
+/* Open the counters of the calling thread.
+ * Return the number of counters available.
+ */
+int perf_open(struct perf_counters *pc);
+
+void perf_close(struct perf_counters *pc);
+
+/* Read the counters, scaling them if the kernel multiplexed them. A counter
+ * that never ran is not available.
+ */
+void perf_read(const struct perf_counters *pc, struct perf_values *pv);
+
+/* @dst += @src. */
+void perf_add(struct perf_values *dst, const struct perf_values *src);
+
+/* Print the counters normalized per message and per byte. */
+void perf_print(FILE *f, const char *name, const struct perf_values *pv,
+	unsigned long msgs, unsigned long bytes);
+
+/* Same as perf_print(), but as the members of a JSON object. */
+void perf_print_json(FILE *f, const struct perf_values *pv,
+	unsigned long msgs, unsigned long bytes);
+
+#endif /* _ECHO_PERF_H */
@@ -0,0 +1,334 @@
+/*
+ * epool.c
+ *
+ * This file implements the buffer pool of the echo server and clients.
+ *
+ * Memory is mapped in 2MB chunks, and each chunk is carved into buffers of
+ * a single size class. Chunks can be backed by hugepages, and can be
+ * prefaulted and locked in memory. Every buffer is preceded by a header
+ * that records its class. Each thread keeps its own free list per class,
+ * so getting and putting buffers takes no lock; only carving a new chunk
+ * does. When a thread exits, its free lists go to a shared list, and the
+ * next thread that runs out of buffers takes them before mapping a chunk.
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "eutils.h"
+#include "epool.h"
+
+#define CHUNK_SIZE	(2 * 1024 * 1024)
+#define HDR_SIZE	64
+#define N_CLASSES	6	/* 2KB to 64KB. */
+#define OVERSIZE	N_CLASSES
+
+struct buf_hdr {
+	struct buf_hdr	*next;
+	unsigned int	cls;
+	/* Only for oversize buffers. */
+	int		locked;
+	size_t		map_len;
+} __attribute__((aligned(HDR_SIZE)));
+
+struct class_stats {
+	_Atomic unsigned long	total;
+	_Atomic unsigned long	in_use;
+};
+
+static int pool_flags;
+
+static struct class_stats stats[N_CLASSES + 1];
+static _Atomic unsigned long mapped_bytes;
+static _Atomic unsigned long huge_chunks;
+static _Atomic unsigned long thp_chunks;
+static _Atomic unsigned long locked_bytes;
+static _Atomic int lock_failed;
+
+static pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Buffers of exited threads, under @chunk_lock. */
+static struct buf_hdr *orphans[N_CLASSES];
+static pthread_key_t exit_key;
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static __thread struct buf_hdr *free_lists[N_CLASSES];
+static __thread int exit_armed;
+
+/**
+ * thread_exit(): Hand the free lists of the exiting thread to @orphans.
+ */
+static void thread_exit(void *arg)
+{
+	unsigned int cls;
+
+	UNUSED(arg);
+	pthread_mutex_lock(&chunk_lock);
+	for (cls = 0; cls < N_CLASSES; cls++) {
+		struct buf_hdr *tail = free_lists[cls];
+
+		if (!tail)
+			continue;
+		while (tail->next)
+			tail = tail->next;
+		tail->next = orphans[cls];
+		orphans[cls] = free_lists[cls];
+		free_lists[cls] = NULL;
+	}
+	pthread_mutex_unlock(&chunk_lock);
+}
+
+static void exit_key_create(void)
+{
+	assert(!pthread_key_create(&exit_key, thread_exit));
+}
+
+/**
+ * arm_exit(): Make sure thread_exit() runs when the calling thread exits.
+ */
+static void arm_exit(void)
+{
+	if (exit_armed)
+		return;
+	assert(!pthread_once(&exit_once, exit_key_create));
+	/* Destructors only run for non-NULL values. */
+	assert(!pthread_setspecific(exit_key, &exit_armed));
+	exit_armed = 1;
+}
+
+void pool_init(int flags)
+{
+	pool_flags = flags;
+	if (!(flags & POOL_PREFILL))
+		return;
+
+	pool_prefill(0);
+	fprintf(stderr, "pool: %.1fMB pinned, %lu hugepages, "
+		"%lu transparent hugepage chunks\n",
+		atomic_load(&locked_bytes) / (1024.0 * 1024.0),
+		atomic_load(&huge_chunks), atomic_load(&thp_chunks));
+}
+
+static inline size_t class_size(unsigned int cls)
+{
+	return (size_t)POOL_MIN_SIZE << cls;
+}
+
+static inline unsigned int size_class(size_t size)
+{
+	unsigned int cls = 0;
+
+	while (cls < N_CLASSES && class_size(cls) < size)
+		cls++;
+	return cls;
+}
+
+/**
+ * map_thp(): Map a chunk aligned to CHUNK_SIZE, and ask for transparent
+ * hugepages to back it. Return MAP_FAILED on failure.
+ */
+static void *map_thp(void)
+{
+	char *p = mmap(NULL, 2 * CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *aligned;
+
+	if (p == MAP_FAILED)
+		return p;
+
+	/* Trim the mapping down to an aligned chunk. */
+	aligned = (char *)(((uintptr_t)p + CHUNK_SIZE - 1) &
+		~(uintptr_t)(CHUNK_SIZE - 1));
+	if (aligned > p)
+		assert(!munmap(p, aligned - p));
+	if (aligned + CHUNK_SIZE < p + 2 * CHUNK_SIZE)
+		assert(!munmap(aligned + CHUNK_SIZE,
+			p + 2 * CHUNK_SIZE - (aligned + CHUNK_SIZE)));
+
+	if (madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE)) {
+		assert(!munmap(aligned, CHUNK_SIZE));
+		return MAP_FAILED;
+	}
+	atomic_fetch_add(&thp_chunks, 1);
+	return aligned;
+}
+
+/**
+ * lock_memory(): Prefault and pin @len bytes at @p. A failure, typically
+ * RLIMIT_MEMLOCK, is reported once, and leaves the memory unpinned.
+ * Return true if the memory is pinned.
+ */
+static int lock_memory(void *p, size_t len)
+{
+	if (!mlock(p, len)) {
+		atomic_fetch_add(&locked_bytes, len);
+		return 1;
+	}
+	if (!atomic_exchange(&lock_failed, 1))
+		fprintf(stderr, "pool: mlock errno=%i: %s, memory is not "
+			"pinned\n", errno, strerror(errno));
+	/* At least, prefault it. */
+	memset(p, 0, len);
+	return 0;
+}
+
+/**
+ * map_memory(): Map @len bytes, with hugepages when the pool asks for them
+ * and @len is a chunk. If @plocked isn't NULL, it receives whether
+ * the memory is pinned.
+ */
+static void *map_memory(size_t len, int *plocked)
+{
+	int locked = 0;
+	void *p = MAP_FAILED;
+
+	if ((pool_flags & POOL_HUGE) && len == CHUNK_SIZE) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+			atomic_fetch_add(&huge_chunks, 1);
+		else
+			p = map_thp();
+	}
+	if (p == MAP_FAILED)
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	assert(p != MAP_FAILED);
+	atomic_fetch_add(&mapped_bytes, len);
+
+	if (pool_flags & POOL_LOCK)
+		locked = lock_memory(p, len);
+	if (plocked)
+		*plocked = locked;
+	return p;
+}
+
+/**
+ * carve_chunk(): Put buffers of class @cls on the free list of the calling
+ * thread, those that exited threads left if there are any, or else those
+ * of a new chunk.
+ */
+static void carve_chunk(unsigned int cls)
+{
+	size_t stride = HDR_SIZE + class_size(cls);
+	int i, n = CHUNK_SIZE / stride;
+	char *chunk;
+
+	arm_exit();
+	pthread_mutex_lock(&chunk_lock);
+	if (orphans[cls]) {
+		/* A chunk's worth at most, so that the threads starting
+		 * together share them.
+		 */
+		for (i = 0; i < n && orphans[cls]; i++) {
+			struct buf_hdr *hdr = orphans[cls];
+
+			orphans[cls] = hdr->next;
+			hdr->next = free_lists[cls];
+			free_lists[cls] = hdr;
+		}
+		pthread_mutex_unlock(&chunk_lock);
+		return;
+	}
+	chunk = map_memory(CHUNK_SIZE, NULL);
+	pthread_mutex_unlock(&chunk_lock);
+
+	for (i = n - 1; i >= 0; i--) {
+		struct buf_hdr *hdr = (struct buf_hdr *)(chunk + i * stride);
+		hdr->cls = cls;
+		hdr->next = free_lists[cls];
+		free_lists[cls] = hdr;
+	}
+	atomic_fetch_add_explicit(&stats[cls].total, n, memory_order_relaxed);
+}
+
+void pool_prefill(size_t size)
+{
+	unsigned int cls;
+
+	if (size) {
+		cls = size_class(size);
+		if (cls < N_CLASSES)
+			carve_chunk(cls);
+		return;
+	}
+	for (cls = 0; cls < N_CLASSES; cls++)
+		carve_chunk(cls);
+}
+
+void *pool_get(size_t size)
+{
+	unsigned int cls = size_class(size);
+	struct buf_hdr *hdr;
+
+	if (cls == OVERSIZE) {
+		size_t len = HDR_SIZE + size;
+		int locked;
+
+		hdr = map_memory(len, &locked);
+		hdr->cls = OVERSIZE;
+		hdr->locked = locked;
+		hdr->map_len = len;
+		atomic_fetch_add_explicit(&stats[cls].total, 1,
+			memory_order_relaxed);
+	} else {
+		if (!free_lists[cls])
+			carve_chunk(cls);
+		hdr = free_lists[cls];
+		free_lists[cls] = hdr->next;
+	}
+
+	atomic_fetch_add_explicit(&stats[cls].in_use, 1, memory_order_relaxed);
+	return (char *)hdr + HDR_SIZE;
+}
+
+void pool_put(void *buf)
+{
+	struct buf_hdr *hdr = (struct buf_hdr *)((char *)buf - HDR_SIZE);
+	unsigned int cls = hdr->cls;
+
+	assert(cls <= OVERSIZE);
+	atomic_fetch_sub_explicit(&stats[cls].in_use, 1, memory_order_relaxed);
+
+	if (cls == OVERSIZE) {
+		atomic_fetch_sub_explicit(&stats[cls].total, 1,
+			memory_order_relaxed);
+		atomic_fetch_sub(&mapped_bytes, hdr->map_len);
+		if (hdr->locked)
+			atomic_fetch_sub(&locked_bytes, hdr->map_len);
+		assert(!munmap(hdr, hdr->map_len));
+		return;
+	}
+
+	hdr->next = free_lists[cls];
+	free_lists[cls] = hdr;
+}
+
+void pool_report(FILE *f, void *arg)
+{
+	unsigned int cls;
+
+	UNUSED(arg);
+	fprintf(f, "pool: %.1fMB mapped, %.1fMB pinned, %lu hugepages, "
+		"%lu transparent hugepage chunks\n",
+		atomic_load(&mapped_bytes) / (1024.0 * 1024.0),
+		atomic_load(&locked_bytes) / (1024.0 * 1024.0),
+		atomic_load(&huge_chunks), atomic_load(&thp_chunks));
+	for (cls = 0; cls <= OVERSIZE; cls++) {
+		unsigned long total = atomic_load(&stats[cls].total);
+
+		if (!total)
+			continue;
+		if (cls == OVERSIZE)
+			fprintf(f, "\toversize: %lu in use\n",
+				atomic_load(&stats[cls].in_use));
+		else
+			fprintf(f, "\t%zuKB: %lu/%lu in use\n",
+				class_size(cls) / 1024,
+				atomic_load(&stats[cls].in_use), total);
+	}
+}
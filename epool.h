@@ -0,0 +1,53 @@
+/*
+ * epool.h
+ *
+ * A header file for the buffer pool from which all I/O paths of the echo
+ * server and clients draw their buffers.
+ *
+ */
+
+#ifndef _ECHO_POOL_H
+#define _ECHO_POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* Buffers come in size classes that are powers of 2 from POOL_MIN_SIZE
+ * to POOL_MAX_SIZE. Larger requests are mapped and unmapped on demand, and
+ * are reported as oversize.
+ */
+#define POOL_MIN_SIZE	2048
+#define POOL_MAX_SIZE	(64 * 1024)
+
+/* Flags of pool_init(). */
+#define POOL_HUGE	1	/* Back the pool with 2MB hugepages. */
+#define POOL_LOCK	2	/* Prefault and mlock the pool. */
+#define POOL_PREFILL	4	/* Prefill the calling thread. */
+
+/* Optional, the pool works with no flags without being initialized.
+ * It must be called before the first buffer is taken from the pool.
+ * POOL_HUGE tries MAP_HUGETLB first, and falls back to transparent
+ * hugepages. With POOL_PREFILL, pool_prefill(0) is called for the calling
+ * thread, and the amount of memory pinned is printed to stderr; programs
+ * whose buffers are used by other threads leave it out.
+ */
+void pool_init(int flags);
+
+/* Carve a chunk of the size class of @size, or one chunk of each class
+ * if @size is 0, into the free lists of the calling thread, so the steady
+ * state takes no page fault. Threads other than the one that called
+ * pool_init() call it themselves. Buffers that exited threads left are
+ * taken first.
+ */
+void pool_prefill(size_t size);
+
+/* Return a buffer of at least @size bytes. Never fails. */
+void *pool_get(size_t size);
+
+/* Give a buffer back to the pool of the calling thread. */
+void pool_put(void *buf);
+
+/* Print the occupancy of each size class. */
+void pool_report(FILE *f, void *arg);
+
+#endif /* _ECHO_POOL_H */
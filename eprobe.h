@@ -0,0 +1,97 @@
+/*
+ * eprobe.h
+ *
+ * Static tracepoints (USDT) for the hot paths of the echo server and
+ * clients. A probe is a single nop plus a note in the .note.stapsdt section
+ * of the binary, so it costs nothing unless a tracer attaches to it,
+ * for example:
+ *
+ *	perf probe -x ./eserv sdt_echo:accept
+ *	bpftrace -e 'usdt:./eserv:echo:partial_io { printf("%d\n", arg2); }'
+ *
+ * All probes belong to the provider "echo", and their arguments are longs:
+ *	accept(fd)
+ *	close(fd, bytes)
+ *	dgram_recv(fd, len)
+ *	send(fd, len, rc)
+ *	partial_io(fd, wanted, done, is_write)
+ *	recv_timeout(fd, n_sent)
+ *
+ * When <sys/sdt.h> from SystemTap is available, it is used. Otherwise,
+ * the same note format is emitted here for x86-64 and AArch64, and the
+ * probes compile to nothing on other architectures.
+ *
+ */
+
+#ifndef _ECHO_PROBE_H
+#define _ECHO_PROBE_H
+
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define EPROBE1(name, a)		DTRACE_PROBE1(echo, name, a)
+#define EPROBE2(name, a, b)		DTRACE_PROBE2(echo, name, a, b)
+#define EPROBE3(name, a, b, c)		DTRACE_PROBE3(echo, name, a, b, c)
+#define EPROBE4(name, a, b, c, d)	DTRACE_PROBE4(echo, name, a, b, c, d)
+
+#elif defined(__x86_64__) || defined(__aarch64__)
+
+/* The layout of the note follows SystemTap's <sys/sdt.h>: the address of
+ * the nop, the address of .stapsdt.base to adjust for prelinking,
+ * the address of a semaphore (none here), provider, name, and a string
+ * that describes where each argument is, "-8@<operand>" for a long.
+ */
+#define __EPROBE_NOTE(name, args)					\
+	"990:	nop\n"							\
+	".pushsection .note.stapsdt,\"?\",\"note\"\n"			\
+	".balign 4\n"							\
+	".4byte 992f-991f, 994f-993f, 3\n"				\
+	"991:	.asciz \"stapsdt\"\n"					\
+	"992:	.balign 4\n"						\
+	"993:	.8byte 990b\n"						\
+	".8byte _.stapsdt.base\n"					\
+	".8byte 0\n"							\
+	".asciz \"echo\"\n"						\
+	".asciz \"" #name "\"\n"					\
+	".asciz \"" args "\"\n"						\
+	"994:	.balign 4\n"						\
+	".popsection\n"							\
+	".ifndef _.stapsdt.base\n"					\
+	".pushsection .stapsdt.base,\"aG\",\"progbits\","		\
+		".stapsdt.base,comdat\n"				\
+	".weak _.stapsdt.base\n"					\
+	".hidden _.stapsdt.base\n"					\
+	"_.stapsdt.base: .space 1\n"					\
+	".size _.stapsdt.base, 1\n"					\
+	".popsection\n"							\
+	".endif\n"
+
+#define EPROBE1(name, a)						\
+	__asm__ __volatile__(__EPROBE_NOTE(name, "-8@%0")		\
+		: : "r"((long)(a)))
+#define EPROBE2(name, a, b)						\
+	__asm__ __volatile__(__EPROBE_NOTE(name, "-8@%0 -8@%1")	\
+		: : "r"((long)(a)), "r"((long)(b)))
+#define EPROBE3(name, a, b, c)						\
+	__asm__ __volatile__(						\
+		__EPROBE_NOTE(name, "-8@%0 -8@%1 -8@%2")		\
+		: : "r"((long)(a)), "r"((long)(b)), "r"((long)(c)))
+#define EPROBE4(name, a, b, c, d)					\
+	__asm__ __volatile__(						\
+		__EPROBE_NOTE(name, "-8@%0 -8@%1 -8@%2 -8@%3")		\
+		: : "r"((long)(a)), "r"((long)(b)), "r"((long)(c)),	\
+		"r"((long)(d)))
+
+#else
+
+#define EPROBE1(name, a)		do { (void)(a); } while (0)
+#define EPROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define EPROBE3(name, a, b, c)						\
+	do { (void)(a); (void)(b); (void)(c); } while (0)
+#define EPROBE4(name, a, b, c, d)					\
+	do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+
+#endif
+
+#endif /* _ECHO_PROBE_H */
@@ -10,33 +10,552 @@
  *
  */
 
+#define _GNU_SOURCE	/* accept4() */
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
 #include "eutils.h"
+#include "elog.h"
+#include "ehist.h"
+#include "estats.h"
+#include "eperf.h"
+#include "eprobe.h"
+#include "epool.h"
+#include "ezcopy.h"
+#include "etimer.h"
+#include "euring.h"
+#include "epacket.h"
+#include "exdp.h"
+#include "elimit.h"
+#include "eflow.h"
+#include "etwamp.h"
 
+/* Resolution of the connection timeouts. */
+#define TICK_NS		(10 * 1000 * 1000UL)
+#define MAX_EVENTS	256
+/* Bytes a stream connection may echo per round, see conn_ready(). */
+#define DEFAULT_QUANTUM	(16 * 1024)
+/* How long closing a connection waits for its zero-copy sends. The server
+ * serves no one meanwhile, so it is short.
+ */
+#define CLOSE_ZC_WAIT_MS	20
+/* Sources the rate limiter tracks, its table takes 48 bytes per slot. */
+#define LIMIT_SOURCES	4096
+/* Peers the flow table tracks, its table takes 96 bytes per slot. */
+#define FLOW_PEERS	16384
+/* Clients the datagram source sends to at once. */
+#define SOURCE_SINKS	64
+/* How long the datagram source keeps sending without a new request. */
+#define SOURCE_TTL_NS	(1000 * 1000 * 1000UL)
+/* Datagrams the source sends between checks for requests. */
+#define SOURCE_BATCH	64
+/* How often the TWAMP reflector reads the error estimate of the clock. */
+#define TWAMP_ERROR_NS	(1000 * 1000 * 1000UL)
+
+/* Time from reading data until it is fully written back.
+ * eserv runs a single worker, so there is a single histogram, and
+ * each of its samples is an echoed message.
+ */
+static struct hist turnaround;
+static unsigned long echoed_bytes_total;
+
+static struct perf_counters worker_perf;
+
+/* How the datagram server does I/O, see -e. */
+enum engine {
+	ENGINE_CLASSIC,		/* datagram_loop() */
+	ENGINE_URING,		/* uring_datagram_loop() */
+	ENGINE_URING_SQPOLL,	/* uring_datagram_loop() with SQPOLL */
+	ENGINE_PACKET,		/* packet_datagram_loop() */
+	ENGINE_XDP,		/* xdp_datagram_loop() */
+};
+
+static const char *engine_names[] = {
+	[ENGINE_CLASSIC]	= "classic",
+	[ENGINE_URING]		= "uring",
+	[ENGINE_URING_SQPOLL]	= "uring-sqpoll",
+	[ENGINE_PACKET]		= "packet",
+	[ENGINE_XDP]		= "xdp",
+};
+
+static enum engine engine = ENGINE_CLASSIC;
+
+/* Interface of the engines that bypass the sockets. */
+static const char *ifname = "lo";
+
+/* Per-source rate limits of the datagram loop, see -r and -R. */
+static struct rate_limit limiter;
+static int limiting;
+
+/* What the loops do with the data of the clients, see -m. */
+static enum echo_mode mode = MODE_ECHO;
+/* Messages and bytes dropped by the discard and source modes, or sent
+ * by the source mode.
+ */
+static unsigned long mode_msgs_in, mode_bytes_in;
+static unsigned long mode_msgs_out, mode_bytes_out;
+
+/* Test packets of -m twamp that were too short, or lacked a kernel RX
+ * timestamp and got one from user space instead.
+ */
+static unsigned long twamp_short, twamp_untimed;
+
+/* Traffic per peer of both loops, see -f. */
+static struct flow_table flows;
+static int tracking;
+
+/* Zero-copy state of the datagram socket. */
+static struct zc_socket dgram_zc;
+
+/* Connection timeouts in milliseconds, 0 disables them. A connection is
+ * idle when nothing has been echoed for the idle timeout.
+ */
+static unsigned long idle_ms, life_ms;
+
+/* Quantum of deficit round robin in bytes, 0 disables it. */
+static long quantum = DEFAULT_QUANTUM;
+
+/* Counters of the stream loop, only the worker updates them. */
+static unsigned long conns_open, conns_accepted;
+static unsigned long idle_timeouts, life_timeouts;
+static unsigned long yields;
+
+/* A connection of the stream loop. The listening socket has no such
+ * structure, its epoll events carry NULL instead.
+ */
+struct conn {
+	struct copy_state	copy;
+	uint32_t		events;		/* Events waited for. */
+	uint32_t		ready;		/* Not served yet. */
+	long			deficit;
+	int			queued;
+	struct conn		*rq_next;
+	struct conn		*rq_prev;
+	struct timer		idle;
+	struct timer		life;
+	socklen_t		peer_len;
+	struct tmp_sockaddr_storage peer;
+};
+
+/* Run queue of the connections that have something to do. */
+static struct conn *rq_head, *rq_tail;
+static unsigned long rq_len;
+
+static int epfd, listener;
+static struct wheel conn_wheel;
+/* Re-enables accept() after running out of descriptors. */
+static struct timer accept_timer;
+
+static void report_turnaround(FILE *f, void *arg)
+{
+	UNUSED(arg);
+	hist_print(f, "turnaround", &turnaround);
+}
+
+static void report_perf(FILE *f, void *arg)
+{
+	struct perf_values pv;
+
+	UNUSED(arg);
+	perf_read(&worker_perf, &pv);
+	perf_print(f, "worker counters", &pv, turnaround.count,
+		echoed_bytes_total);
+}
+
+static void report_conns(FILE *f, void *arg)
+{
+	UNUSED(arg);
+	fprintf(f, "connections: %lu open, %lu accepted, "
+		"%lu idle timeouts, %lu lifetime timeouts, "
+		"%lu quantum yields\n", conns_open, conns_accepted,
+		idle_timeouts, life_timeouts, yields);
+}
+
+static void report_mode(FILE *f, void *arg)
+{
+	UNUSED(arg);
+	fprintf(f, "%s: %lu messages, %lu bytes received; %lu messages, "
+		"%lu bytes sent\n", mode_names[mode], mode_msgs_in,
+		mode_bytes_in, mode_msgs_out, mode_bytes_out);
+}
+
+static void report_twamp(FILE *f, void *arg)
+{
+	UNUSED(arg);
+	fprintf(f, "twamp: %lu reflected, %lu too short, %lu without a "
+		"kernel timestamp\n", turnaround.count, twamp_short,
+		twamp_untimed);
+}
+
+static void watch(int fd, void *ptr, uint32_t events, int op)
+{
+	struct epoll_event ev = {.events = events, .data.ptr = ptr};
+
+	assert(!epoll_ctl(epfd, op, fd, &ev));
+}
+
+static void rq_add(struct conn *c)
+{
+	c->rq_next = NULL;
+	c->rq_prev = rq_tail;
+	if (rq_tail)
+		rq_tail->rq_next = c;
+	else
+		rq_head = c;
+	rq_tail = c;
+	c->queued = 1;
+	rq_len++;
+}
+
+static void rq_del(struct conn *c)
+{
+	if (c->rq_prev)
+		c->rq_prev->rq_next = c->rq_next;
+	else
+		rq_head = c->rq_next;
+	if (c->rq_next)
+		c->rq_next->rq_prev = c->rq_prev;
+	else
+		rq_tail = c->rq_prev;
+	c->queued = 0;
+	rq_len--;
+}
+
+/**
+ * conn_close(): Close @c. If @abort is true, the connection is reset,
+ * so the kernel drops what it has not sent yet.
+ */
+static void conn_close(struct conn *c, int abort)
+{
+	int fd = c->copy.to;
+	unsigned long copied;
+
+	if (abort) {
+		struct linger lg = {.l_onoff = 1, .l_linger = 0};
+
+		assert(!setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg,
+			sizeof(lg)));
+	}
+	if (c->queued)
+		rq_del(c);
+	timer_cancel(&conn_wheel, &c->idle);
+	timer_cancel(&conn_wheel, &c->life);
+	/* A reset connection completes no more sends. */
+	copied = copy_end(&c->copy, abort ? 0 : CLOSE_ZC_WAIT_MS);
+	echoed_bytes_total += copied;
+	EPROBE2(close, fd, copied);
+	elog(ELOG_CLOSE, fd, 0, 0);
+	/* Closing also removes @fd from the epoll instance. */
+	close(fd);
+	free(c);
+	conns_open--;
+}
+
+/**
+ * conn_stalled(): Return true if @c still has data to send.
+ */
+static int conn_stalled(const struct conn *c)
+{
+	return c->copy.len || c->copy.resp_len ||
+		(c->copy.zc && zc_in_flight(c->copy.zc));
+}
+
+static void idle_expired(struct timer *t)
+{
+	struct conn *c = timer_entry(t, struct conn, idle);
+
+	idle_timeouts++;
+	conn_close(c, conn_stalled(c));
+}
+
+static void life_expired(struct timer *t)
+{
+	struct conn *c = timer_entry(t, struct conn, life);
+
+	life_timeouts++;
+	conn_close(c, conn_stalled(c));
+}
+
+static void resume_accept(struct timer *t)
+{
+	UNUSED(t);
+	watch(listener, NULL, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+/**
+ * conn_ready(): Copy what @c has to copy, and wait for what blocks it.
+ * Connections take turns in deficit round robin: on each turn, the
+ * deficit of @c grows by the quantum, and the bytes echoed are taken
+ * from it. A connection that runs out goes to the back of the run queue,
+ * so a bulk transfer cannot delay small echoes by more than a quantum per
+ * connection. Since reads are cut to the deficit, it is only carried over
+ * while data is ready, and starts over once the connection waits.
+ */
+static void conn_ready(struct conn *c)
+{
+	unsigned long copied = c->copy.copied, received = c->copy.received;
+	unsigned long msgs = turnaround.count, lat = turnaround.sum;
+	uint32_t events = c->ready, want;
+	int rc;
+
+	c->ready = 0;
+	if (quantum)
+		c->deficit += quantum;
+
+	/* POLLERR also signals zero-copy completions. */
+	if (c->copy.zc && (events & EPOLLERR))
+		zc_reap(c->copy.zc, 0);
+
+	switch (mode) {
+	case MODE_DISCARD:
+		rc = discard_data(&c->copy, quantum ? &c->deficit : NULL);
+		break;
+	case MODE_SOURCE:
+	case MODE_BIDIR:
+		rc = source_data(&c->copy, quantum ? &c->deficit : NULL);
+		break;
+	case MODE_RPC:
+		rc = rpc_data(&c->copy, &turnaround,
+			quantum ? &c->deficit : NULL);
+		break;
+	default:
+		rc = copy_data(&c->copy, &turnaround,
+			quantum ? &c->deficit : NULL);
+		break;
+	}
+	if (tracking && c->copy.copied != copied) {
+		/* Only the total time of the messages echoed in this round
+		 * is known, so their mean stands for their maximum.
+		 */
+		msgs = turnaround.count - msgs;
+		lat = turnaround.sum - lat;
+		flow_account(&flows, (struct sockaddr *)&c->peer, c->peer_len,
+			msgs, c->copy.copied - copied, lat,
+			msgs ? lat / msgs : 0, now_ns());
+	}
+
+	switch (rc) {
+	case COPY_EOF:
+		conn_close(c, 0);
+		return;
+	case COPY_AGAIN:
+		want = EPOLLIN;
+		break;
+	case COPY_BLOCKED:
+		/* A bidir peer keeps sending while the pattern blocks. */
+		want = mode == MODE_BIDIR ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+		break;
+	case COPY_ZC_WAIT:
+		/* A reset peer never gets the sends to complete. */
+		if (events & EPOLLHUP) {
+			conn_close(c, 1);
+			return;
+		}
+		want = 0;
+		break;
+	case COPY_YIELD:
+		yields++;
+		rq_add(c);
+		want = c->events;
+		break;
+	default:
+		assert(0);
+	}
+
+	if (!c->queued)
+		c->deficit = 0;
+	/* A bidir peer that sends while the pattern blocks is not idle. */
+	if (idle_ms && (c->copy.copied != copied ||
+		c->copy.received != received))
+		timer_arm(&conn_wheel, &c->idle, now_ns() + idle_ms * 1000000);
+	if (want != c->events) {
+		watch(c->copy.to, c, want, EPOLL_CTL_MOD);
+		c->events = want;
+	}
+}
+
+static void accept_conns(void)
+{
+	while (1) {
+		struct tmp_sockaddr_storage peer;
+		socklen_t peer_len = sizeof(peer);
+		int fd = accept4(listener, (struct sockaddr *)&peer,
+			&peer_len, SOCK_NONBLOCK);
+		unsigned long now;
+		struct conn *c;
+
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE ||
+				errno == ENOBUFS || errno == ENOMEM) {
+				/* Stop accepting for a tick, rather than
+				 * spinning on the pending connection.
+				 */
+				watch(listener, NULL, 0, EPOLL_CTL_MOD);
+				timer_arm(&conn_wheel, &accept_timer,
+					now_ns() + TICK_NS);
+				return;
+			}
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			return;
+		}
+
+		EPROBE1(accept, fd);
+		elog(ELOG_CONNECT, fd, 0, 0);
+		c = malloc(sizeof(*c));
+		assert(c);
+		/* Bidir reads as much as it writes. */
+		copy_init(&c->copy, fd, fd, mode == MODE_BIDIR);
+		/* A source has something to send right away. */
+		c->events = mode == MODE_SOURCE || mode == MODE_BIDIR ?
+			EPOLLOUT : EPOLLIN;
+		c->ready = 0;
+		c->deficit = 0;
+		c->queued = 0;
+		c->peer = peer;
+		c->peer_len = peer_len;
+		timer_init(&c->idle, idle_expired);
+		timer_init(&c->life, life_expired);
+		now = now_ns();
+		if (idle_ms)
+			timer_arm(&conn_wheel, &c->idle,
+				now + idle_ms * 1000000);
+		if (life_ms)
+			timer_arm(&conn_wheel, &c->life,
+				now + life_ms * 1000000);
+		watch(fd, c, c->events, EPOLL_CTL_ADD);
+		conns_open++;
+		conns_accepted++;
+	}
+}
+
+/**
+ * raise_fd_limit(): Allow as many descriptors as the hard limit does,
+ * since each connection takes one.
+ */
+static void raise_fd_limit(void)
+{
+	struct rlimit rl;
+
+	assert(!getrlimit(RLIMIT_NOFILE, &rl));
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		fprintf(stderr, "%s: setrlimit errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+}
+
+/**
+ * stream_loop(): Serve all connections from a single thread. Sockets are
+ * non-blocking and epoll tells which ones are ready. The timeouts of all
+ * connections live in a timing wheel, so arming, re-arming, and cancelling
+ * them costs no system call, and the loop only wakes up once per tick
+ * while any is pending.
+ */
 static void stream_loop(int sock)
 {
-	int conn;
+	struct epoll_event events[MAX_EVENTS];
+
+	raise_fd_limit();
+	listener = sock;
+	assert(!fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK));
+	assert(!listen(sock, SOMAXCONN));
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	assert(epfd >= 0);
+	watch(sock, NULL, EPOLLIN, EPOLL_CTL_ADD);
+	wheel_init(&conn_wheel, TICK_NS, now_ns());
+	timer_init(&accept_timer, resume_accept);
+	stats_register(report_conns, NULL);
+
+	while (1) {
+		int i, n, timeout = rq_head ? 0 :
+			wheel_timeout_ms(&conn_wheel, now_ns());
+
+		/* An epoll instance is readable while events are ready. */
+		if (timeout)
+			busy_spin(epfd, POLLIN);
+		n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+		assert(n >= 0 || errno == EINTR);
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
 
-	assert(!listen(sock, 5));
+			if (!c) {
+				accept_conns();
+				continue;
+			}
+			c->ready |= events[i].events;
+			if (!c->queued)
+				rq_add(c);
+		}
 
-	while ((conn = accept(sock, NULL, NULL)) >= 0) {
-		printf("---- Connect()\n");
-		copy_data(conn, conn);
-		printf("---- Close()\n");
-		close(conn);
+		/* One round, connections that yield join the next one. */
+		for (n = rq_len; n > 0; n--) {
+			struct conn *c = rq_head;
+
+			rq_del(c);
+			conn_ready(c);
+		}
+		wheel_advance(&conn_wheel, now_ns());
 	}
+}
+
+/**
+ * rpc_respond(): Send the response to the request @req of @req_len bytes
+ * to @cli, straight from the header and the pattern. Return the size of
+ * the response, or -1 if @req is not a request.
+ */
+static int rpc_respond(int s, const char *req, int req_len,
+	const struct sockaddr *cli, socklen_t cli_len)
+{
+	const struct rpc_hdr *rh = (const struct rpc_hdr *)req;
+	struct frame_hdr hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint32_t resp_len;
 
-	assert(conn >= 0);
+	if (req_len < (int)sizeof(*rh))
+		return -1;
+	resp_len = be32toh(rh->resp_len);
+	if (resp_len < sizeof(hdr))
+		resp_len = sizeof(hdr);
+	if (resp_len > MAX_UDP)
+		resp_len = MAX_UDP;
+	hdr.len = htobe32(resp_len);
+	hdr.id = rh->frame.id;
+	hdr.ts = rh->frame.ts;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)pattern();
+	iov[1].iov_len = resp_len - sizeof(hdr);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = (void *)cli;
+	msg.msg_namelen = cli_len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (sendmsg(s, &msg, 0) < 0) {
+		fprintf(stderr, "%s: sendmsg errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		exit(1);
+	}
+	return resp_len;
 }
 
 /**
- * echo(): Receive a message of msg_len size, allocate memory using alloca(),
+ * echo(): Receive a message of msg_len size into a buffer from the pool,
  * and echo the message back to the source.
  */
 static void echo(int s, int msg_len)
@@ -44,24 +563,415 @@ static void echo(int s, int msg_len)
 	struct tmp_sockaddr_storage cli_stack;
 	struct sockaddr *cli = (struct sockaddr *)&cli_stack;
 	unsigned int len = sizeof(cli_stack);
-	char *msg = alloca(msg_len);
+	char *msg = pool_get(msg_len);
 	int read = recvfrom(s, msg, msg_len, 0, cli, &len);
+	unsigned long start = now_ns(), end;
+	EPROBE2(dgram_recv, s, read);
 	assert(read == msg_len);
-	send_packet(s, msg, msg_len, cli, len);
+	if (mode == MODE_DISCARD) {
+		mode_msgs_in++;
+		mode_bytes_in += msg_len;
+		pool_put(msg);
+		return;
+	}
+	if (mode == MODE_RPC) {
+		/* The response replaces the request. */
+		msg_len = rpc_respond(s, msg, msg_len, cli, len);
+		pool_put(msg);
+		if (msg_len < 0)
+			return;
+		goto out;
+	}
+	if (limiting && limit_check(&limiter, cli, len, msg_len, start) !=
+		LIMIT_PASS) {
+		pool_put(msg);
+		return;
+	}
+	if (eopts.zerocopy) {
+		/* @msg goes back to the pool once the kernel is done. */
+		assert(zc_send(&dgram_zc, msg, msg_len, cli, len) == msg_len);
+	} else {
+		send_packet(s, msg, msg_len, cli, len);
+		pool_put(msg);
+	}
+out:
+	end = now_ns();
+	hist_add(&turnaround, end - start);
+	echoed_bytes_total += msg_len;
+	if (tracking)
+		flow_account(&flows, cli, len, 1, msg_len, end - start,
+			end - start, end);
+}
+
+/* A client of the datagram source. */
+struct sink {
+	struct tmp_sockaddr_storage	addr;
+	socklen_t			len;
+	int				size;	/* Of its datagrams. */
+	unsigned long			expires;
+};
+
+/**
+ * sink_request(): Start or keep sending datagrams of @size bytes to the
+ * client @addr, or stop if @size is 0. Return the number of sinks.
+ */
+static int sink_request(struct sink *sinks, int n, const struct sockaddr *addr,
+	socklen_t len, int size, unsigned long now)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (sinks[i].len == len && !memcmp(&sinks[i].addr, addr, len))
+			break;
+	if (i == n) {
+		if (!size || n == SOURCE_SINKS)
+			return n;
+		memcpy(&sinks[i].addr, addr, len);
+		sinks[i].len = len;
+		n++;
+	}
+	if (!size) {
+		sinks[i] = sinks[--n];
+		return n;
+	}
+	sinks[i].size = size < PATTERN_SIZE ? size : PATTERN_SIZE;
+	sinks[i].expires = now + SOURCE_TTL_NS;
+	return n;
+}
+
+/**
+ * source_loop(): Send datagrams of the pattern to each client that asked
+ * for them within SOURCE_TTL_NS, in turn, as fast as the socket takes
+ * them. The size of a request is the size of the datagrams it asks for,
+ * and an empty request stops them.
+ */
+static void source_loop(int sock)
+{
+	static struct sink sinks[SOURCE_SINKS];
+	char *req = pool_get(MAX_UDP);
+	const char *p = pattern();
+	int n = 0, next = 0;
+
+	while (1) {
+		struct pollfd pfd = {.fd = sock, .events = POLLIN};
+		unsigned long now = now_ns();
+		int i;
+
+		while (1) {
+			struct tmp_sockaddr_storage addr;
+			socklen_t len = sizeof(addr);
+			int size = recvfrom(sock, req, MAX_UDP, MSG_DONTWAIT,
+				(struct sockaddr *)&addr, &len);
+
+			if (size < 0) {
+				assert(errno == EAGAIN ||
+					errno == EWOULDBLOCK ||
+					errno == ECONNREFUSED);
+				break;
+			}
+			mode_msgs_in++;
+			mode_bytes_in += size;
+			n = sink_request(sinks, n, (struct sockaddr *)&addr,
+				len, size, now);
+		}
+		for (i = 0; i < n; )
+			if (sinks[i].expires <= now)
+				sinks[i] = sinks[--n];
+			else
+				i++;
+
+		/* Requests are only checked between batches. */
+		for (i = 0; i < SOURCE_BATCH && n; i++) {
+			struct sink *s = &sinks[next++ % n];
+
+			if (sendto(sock, p, s->size, MSG_DONTWAIT,
+				(struct sockaddr *)&s->addr, s->len) >= 0) {
+				mode_msgs_out++;
+				mode_bytes_out += s->size;
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				pfd.events |= POLLOUT;
+				break;
+			}
+			/* A sink that went away may refuse datagrams. */
+			assert(errno == ENOBUFS || errno == ECONNREFUSED);
+		}
+		if (n && !(pfd.events & POLLOUT))
+			continue;
+		assert(poll(&pfd, 1, -1) >= 0 || errno == EINTR);
+	}
+}
+
+/**
+ * twamp_loop(): Reflect TWAMP-Light test packets, see struct twamp_test.
+ * The reflector keeps no sessions, so each reflected packet carries the
+ * sequence number of the test packet it answers. It has the size of the
+ * test packet, and at least TWAMP_MIN_SIZE bytes, so padding comes back
+ * as it came.
+ */
+static void twamp_loop(int sock)
+{
+	char *buf = pool_get(MAX_UDP);
+	const struct twamp_test *t = (const struct twamp_test *)buf;
+	unsigned long error_at = 0;
+	uint16_t error = 0;
+
+	if (twamp_enable(sock, 1))
+		exit(1);
+	while (1) {
+		struct tmp_sockaddr_storage cli_stack;
+		struct sockaddr *cli = (struct sockaddr *)&cli_stack;
+		socklen_t len = sizeof(cli_stack);
+		struct twamp_reflect r;
+		unsigned long start, end;
+		uint64_t rx_ts;
+		uint8_t ttl;
+		int size;
+
+		busy_spin(sock, POLLIN);
+		size = twamp_recv(sock, buf, MAX_UDP, 0, cli, &len, &rx_ts,
+			&ttl);
+		assert(size >= 0);
+		start = now_ns();
+		EPROBE2(dgram_recv, sock, size);
+		if (size < (int)sizeof(*t)) {
+			twamp_short++;
+			continue;
+		}
+		if (limiting && limit_check(&limiter, cli, len, size, start) !=
+			LIMIT_PASS)
+			continue;
+		if (!rx_ts) {
+			rx_ts = twamp_now();
+			twamp_untimed++;
+		}
+		if (start >= error_at) {
+			error = twamp_error_estimate();
+			error_at = start + TWAMP_ERROR_NS;
+		}
+
+		memset(&r, 0, sizeof(r));
+		r.seq = t->seq;
+		r.error = htobe16(error);
+		r.rx_ts = htobe64(rx_ts);
+		r.sender_seq = t->seq;
+		r.sender_ts = t->ts;
+		r.sender_error = t->error;
+		r.sender_ttl = ttl;
+		if (size < TWAMP_MIN_SIZE) {
+			memset(buf + size, 0, TWAMP_MIN_SIZE - size);
+			size = TWAMP_MIN_SIZE;
+		}
+		/* As late as the packet allows. */
+		r.ts = htobe64(twamp_now());
+		memcpy(buf, &r, sizeof(r));
+		send_packet(sock, buf, size, cli, len);
+
+		end = now_ns();
+		hist_add(&turnaround, end - start);
+		echoed_bytes_total += size;
+		if (tracking)
+			flow_account(&flows, cli, len, 1, size, end - start,
+				end - start, end);
+	}
 }
 
 static void datagram_loop(int sock)
 {
+	if (eopts.zerocopy && zc_init(&dgram_zc, sock))
+		eopts.zerocopy = 0;
+
 	while (1) {
-		int len = recvfrom(sock, NULL, 0, MSG_PEEK|MSG_TRUNC,
-			NULL, NULL);
+		int len;
+
+		busy_spin(sock, POLLIN);
+		len = recvfrom(sock, NULL, 0, MSG_PEEK|MSG_TRUNC, NULL, NULL);
 		assert(len >= 0);
 		echo(sock, len);
 	}
 }
 
-static int check_srv_params(int *pis_stream, int argc, char * const argv[])
+/**
+ * datagram_engine(): Run the engine of -e, or the classic loop if that
+ * engine is not available.
+ */
+static void datagram_engine(int sock, const struct sockaddr *srv)
+{
+	uint16_t port = ((const struct sockaddr_in *)srv)->sin_port;
+
+	if (mode == MODE_SOURCE)
+		source_loop(sock);
+	if (mode == MODE_TWAMP)
+		twamp_loop(sock);
+
+	switch (engine) {
+	case ENGINE_URING:
+	case ENGINE_URING_SQPOLL:
+		uring_datagram_loop(sock, engine == ENGINE_URING_SQPOLL,
+			&turnaround, &echoed_bytes_total);
+		break;
+	case ENGINE_PACKET:
+		stats_register(packet_report, NULL);
+		packet_datagram_loop(ifname, port, &turnaround,
+			&echoed_bytes_total);
+		break;
+	case ENGINE_XDP:
+		stats_register(xdp_report, NULL);
+		xdp_datagram_loop(ifname, port, &turnaround,
+			&echoed_bytes_total);
+		break;
+	case ENGINE_CLASSIC:
+		break;
+	}
+	if (engine != ENGINE_CLASSIC)
+		fprintf(stderr, "Engine %s is not available, "
+			"falling back to %s\n", engine_names[engine],
+			engine_names[ENGINE_CLASSIC]);
+	datagram_loop(sock);
+}
+
+/**
+ * parse_limit(): Set @bucket of the limiter from @arg, which is
+ * "rate[:burst]". The burst defaults to a tenth of a second at @rate,
+ * and at least @min_burst. Return 0 on success.
+ */
+static int parse_limit(enum limit_bucket bucket, const char *arg,
+	uint64_t min_burst)
+{
+	uint64_t rate, burst;
+	char *end;
+
+	/* strtoull() takes negative numbers, and wraps them around. */
+	if (strchr(arg, '-'))
+		return -1;
+	errno = 0;
+	rate = strtoull(arg, &end, 0);
+	burst = rate / 10;
+	if (*end == ':')
+		burst = strtoull(end + 1, &end, 0);
+	else if (burst < min_burst)
+		burst = min_burst;
+	if (*end || errno || !rate || !burst || burst > LIMIT_MAX_BURST)
+		return -1;
+	if (!limiting) {
+		limit_init(&limiter, LIMIT_SOURCES);
+		limiting = 1;
+	}
+	limit_set(&limiter, bucket, rate, burst);
+	return 0;
+}
+
+/**
+ * parse_engine(): Return the engine named @name, or -1 if there is none.
+ */
+static int parse_engine(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(engine_names) / sizeof(engine_names[0]); i++)
+		if (!strcmp(name, engine_names[i]))
+			return i;
+	return -1;
+}
+
+static int check_srv_params(int *pis_stream, int *pargc, char ***pargv)
 {
+	int argc, opt;
+	char **argv;
+
+	while ((opt = getopt(*pargc, *pargv,
+		"PHzi:L:q:B:e:I:r:R:f:m:")) != -1) {
+		switch (opt) {
+		case 'e': {
+			int e = parse_engine(optarg);
+
+			if (e < 0) {
+				argv = *pargv;
+				goto failure;
+			}
+			engine = e;
+			break;
+		}
+		case 'I':
+			ifname = optarg;
+			break;
+		case 'm': {
+			int m = parse_mode(optarg);
+
+			if (m < 0) {
+				argv = *pargv;
+				goto failure;
+			}
+			mode = m;
+			break;
+		}
+		case 'f': {
+			char *end;
+			long top = strtol(optarg, &end, 0);
+
+			/* No more peers to report than are tracked. */
+			if (*end || top <= 0 || top > FLOW_PEERS) {
+				argv = *pargv;
+				goto failure;
+			}
+			flow_init(&flows, FLOW_PEERS, top);
+			tracking = 1;
+			break;
+		}
+		case 'r':
+			if (parse_limit(LIMIT_MSGS, optarg, 1)) {
+				argv = *pargv;
+				goto failure;
+			}
+			break;
+		case 'R':
+			if (parse_limit(LIMIT_BYTES, optarg, MAX_UDP)) {
+				argv = *pargv;
+				goto failure;
+			}
+			break;
+		case 'B': {
+			char *end;
+
+			eopts.busy_poll = strtol(optarg, &end, 0);
+			if (*end || eopts.busy_poll < 0) {
+				argv = *pargv;
+				goto failure;
+			}
+			break;
+		}
+		case 'i':
+			idle_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			life_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			quantum = strtol(optarg, NULL, 0);
+			if (quantum < 0) {
+				argv = *pargv;
+				goto failure;
+			}
+			break;
+		case 'P':
+			eopts.perf = 1;
+			break;
+		case 'H':
+			eopts.huge = 1;
+			break;
+		case 'z':
+			eopts.zerocopy = 1;
+			break;
+		default:
+			argv = *pargv;
+			goto failure;
+		}
+	}
+	shift_options(pargc, pargv);
+	argc = *pargc;
+	argv = *pargv;
+
 	if (argc != 4)
 		goto failure;
 
@@ -72,16 +982,68 @@ static int check_srv_params(int *pis_stream, int argc, char * const argv[])
 	else
 		goto failure;
 
-	if (!strcmp(argv[2], "xip"))
+	/* The engines only serve datagrams, and only echo them. */
+	if (engine != ENGINE_CLASSIC && (*pis_stream || mode != MODE_ECHO))
+		goto failure;
+	if (!*pis_stream && mode == MODE_BIDIR)
+		goto failure;
+	if (*pis_stream && mode == MODE_TWAMP)
+		goto failure;
+
+	if (!strcmp(argv[2], "xip")) {
+		/* TWAMP carries the TTL of IP. */
+		if (mode == MODE_TWAMP)
+			goto failure;
+		/* Only the io_uring engines go through the sockets. */
+		if (engine == ENGINE_PACKET || engine == ENGINE_XDP)
+			goto failure;
 		return 1;
+	}
 
 	if (!strcmp(argv[2], "ip"))
 		return 0;
 
 failure:
-	printf("usage:\t%s <'datagram' | 'stream'> 'ip' port\n", argv[0]);
-	printf(      "\t%s <'datagram' | 'stream'> 'xip' srv_addr_file\n",
+	printf("usage:\t%s [options] <'datagram' | 'stream'> 'ip' port\n",
 		argv[0]);
+	printf("\t%s [options] <'datagram' | 'stream'> 'xip' "
+		"srv_addr_file\n", argv[0]);
+	printf("options:\n"
+		"\t-P\treport performance counters of the worker\n"
+		"\t-H\tback buffers with hugepages, prefault and pin them\n"
+		"\t-z\techo large messages with MSG_ZEROCOPY\n"
+		"\t-i ms\tclose stream connections idle for ms milliseconds\n"
+		"\t-L ms\tclose stream connections open for ms milliseconds\n"
+		"\t-q bytes\tquantum of round robin across stream "
+		"connections,\n\t\t0 lets each one run until it blocks "
+		"(default %i)\n"
+		"\t-B us\tspin up to us microseconds for requests before "
+		"blocking\n"
+		"\t-e engine\tI/O engine of datagrams: classic (default), "
+		"uring,\n\t\turing-sqpoll, packet (IPv4 only, needs "
+		"CAP_NET_RAW),\n\t\tor xdp (IPv4 only, needs CAP_NET_ADMIN "
+		"and CAP_BPF),\n\t\twhich ignore -z, -B, -r, -R, and -f\n"
+		"\t-I ifname\tinterface of the packet and xdp engines "
+		"(default lo)\n"
+		"\t-r rate[:burst]\tlimit each source host of the classic "
+		"engine to rate\n\t\tdatagrams per second, in bursts of up "
+		"to burst datagrams\n"
+		"\t-R rate[:burst]\tlimit each source host of the classic "
+		"engine to rate\n\t\tbytes per second, in bursts of up "
+		"to burst bytes\n"
+		"\t-f top\ttrack the traffic of each peer of the classic "
+		"engine and of\n\t\tstream connections, and report the top "
+		"peers by bytes\n"
+		"\t-m mode\techo (default); discard to drop what clients "
+		"send; source\n\t\tto send them the character generator "
+		"pattern instead, a\n\t\tdatagram source sends datagrams of "
+		"the size of each request\n\t\tfor a second, an empty one "
+		"stops them; rpc to answer each\n\t\trequest with a response "
+		"of the size it asks for; bidir\n\t\tto drop what stream "
+		"clients send while sending the pattern;\n\t\tor twamp to "
+		"reflect TWAMP-Light test packets (datagram\n\t\tip only, "
+		"see ecli -t)\n",
+		DEFAULT_QUANTUM);
 	exit(1);
 }
 
@@ -90,7 +1052,32 @@ int main(int argc, char *argv[])
 	struct sockaddr *srv;
 	int s, is_xia, is_stream, srv_len;
 
-	is_xia = check_srv_params(&is_stream, argc, argv);
+	is_xia = check_srv_params(&is_stream, &argc, &argv);
+	stats_start();
+	if (eopts.huge)
+		pool_init(POOL_HUGE | POOL_LOCK | POOL_PREFILL);
+	elog_init(stdout);
+	hist_init(&turnaround);
+	stats_register(report_turnaround, NULL);
+	stats_register(pool_report, NULL);
+	if (eopts.zerocopy)
+		stats_register(zc_report, NULL);
+	if (eopts.busy_poll)
+		stats_register(busy_poll_report, NULL);
+	if (limiting)
+		stats_register(limit_report, &limiter);
+	if (tracking)
+		stats_register(flow_report, &flows);
+	/* Connections count their bytes as echoes do. */
+	if ((mode == MODE_DISCARD || mode == MODE_SOURCE) && !is_stream)
+		stats_register(report_mode, NULL);
+	if (mode == MODE_TWAMP)
+		stats_register(report_twamp, NULL);
+	if (eopts.perf) {
+		if (!perf_open(&worker_perf))
+			fprintf(stderr, "No performance counter available\n");
+		stats_register(report_perf, NULL);
+	}
 
 	s = any_socket(is_xia, is_stream);
 	if (s < 0) {
@@ -110,7 +1097,7 @@ int main(int argc, char *argv[])
 	if (is_stream)
 		stream_loop(s);
 	else
-		datagram_loop(s);
+		datagram_engine(s, srv);
 
 	free(srv);
 	assert(!close(s));
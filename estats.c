@@ -0,0 +1,75 @@
+/*
+ * estats.c
+ *
+ * This file implements the statistics reporter of the echo server.
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include "eutils.h"
+#include "estats.h"
+
+#define MAX_REPORTERS 16
+
+static struct reporter {
+	stats_fn_t	fn;
+	void		*arg;
+} reporters[MAX_REPORTERS];
+static int n_reporters;
+static pthread_mutex_t reporters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void stats_register(stats_fn_t fn, void *arg)
+{
+	pthread_mutex_lock(&reporters_lock);
+	assert(n_reporters < MAX_REPORTERS);
+	reporters[n_reporters].fn = fn;
+	reporters[n_reporters].arg = arg;
+	n_reporters++;
+	pthread_mutex_unlock(&reporters_lock);
+}
+
+void stats_report(FILE *f)
+{
+	int i;
+
+	pthread_mutex_lock(&reporters_lock);
+	for (i = 0; i < n_reporters; i++)
+		reporters[i].fn(f, reporters[i].arg);
+	pthread_mutex_unlock(&reporters_lock);
+	fflush(f);
+}
+
+static sigset_t stats_signals;
+
+static void *reporter_main(void *arg)
+{
+	UNUSED(arg);
+	while (1) {
+		int sig;
+
+		assert(!sigwait(&stats_signals, &sig));
+		fprintf(stderr, "---- Statistics%s\n",
+			sig == SIGUSR1 ? "" : " at exit");
+		stats_report(stderr);
+		if (sig != SIGUSR1)
+			exit(0);
+	}
+	return NULL;
+}
+
+void stats_start(void)
+{
+	pthread_t reporter;
+
+	sigemptyset(&stats_signals);
+	sigaddset(&stats_signals, SIGUSR1);
+	sigaddset(&stats_signals, SIGINT);
+	sigaddset(&stats_signals, SIGTERM);
+	assert(!pthread_sigmask(SIG_BLOCK, &stats_signals, NULL));
+
+	assert(!pthread_create(&reporter, NULL, reporter_main, NULL));
+	assert(!pthread_detach(reporter));
+}
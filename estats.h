@@ -0,0 +1,32 @@
+/*
+ * estats.h
+ *
+ * A header file for the statistics reporter of the echo server: a thread
+ * that dumps every registered statistic on SIGUSR1 and at exit.
+ *
+ */
+
+#ifndef _ECHO_STATS_H
+#define _ECHO_STATS_H
+
+#include <stdio.h>
+
+/* Reporting functions are called from the reporter thread while the
+ * owners of the statistics keep updating them, so a report is a snapshot
+ * that may be slightly inconsistent.
+ */
+typedef void (*stats_fn_t)(FILE *f, void *arg);
+
+void stats_register(stats_fn_t fn, void *arg);
+
+/* Call every registered reporting function. */
+void stats_report(FILE *f);
+
+/* Block SIGUSR1, SIGINT, and SIGTERM, and start the reporter thread that
+ * waits for them. This must be called before any other thread is created,
+ * so all threads inherit the signal mask.
+ * On SIGINT and SIGTERM, the statistics are reported and the process exits.
+ */
+void stats_start(void);
+
+#endif /* _ECHO_STATS_H */
@@ -0,0 +1,184 @@
+/*
+ * etimer.c
+ *
+ * This file implements a hierarchical timing wheel.
+ *
+ * Level 0 has a slot per tick for the next WHEEL_SIZE ticks. Each slot of
+ * level n > 0 covers WHEEL_SIZE^n ticks. Whenever the index of a level
+ * wraps around, the next slot of the level above is cascaded, that is,
+ * its timers are placed again, now in lower levels. Arming and cancelling
+ * a timer only link and unlink it, so the cost does not depend on the
+ * number of timers, and a single wakeup per tick serves all of them.
+ *
+ */
+
+#include <assert.h>
+#include "etimer.h"
+
+static inline void link_init(struct timer_link *head)
+{
+	head->next = head->prev = head;
+}
+
+static inline int link_empty(const struct timer_link *head)
+{
+	return head->next == head;
+}
+
+static inline void link_add_tail(struct timer_link *head,
+	struct timer_link *l)
+{
+	l->prev = head->prev;
+	l->next = head;
+	head->prev->next = l;
+	head->prev = l;
+}
+
+static inline void link_del(struct timer_link *l)
+{
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	l->next = l->prev = NULL;
+}
+
+/* Move all entries of @from to the empty list @to. */
+static inline void link_splice(struct timer_link *from, struct timer_link *to)
+{
+	if (link_empty(from)) {
+		link_init(to);
+		return;
+	}
+	to->next = from->next;
+	to->prev = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	link_init(from);
+}
+
+void wheel_init(struct wheel *w, unsigned long tick_ns, unsigned long now_ns)
+{
+	int level, i;
+
+	assert(tick_ns > 0);
+	w->tick_ns = tick_ns;
+	w->start_ns = now_ns;
+	w->now = 0;
+	w->count = 0;
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (i = 0; i < WHEEL_SIZE; i++)
+			link_init(&w->slots[level][i]);
+}
+
+void timer_init(struct timer *t, timer_fn_t fn)
+{
+	t->link.next = t->link.prev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+}
+
+/**
+ * place(): Link @t into the slot that covers its expiration.
+ */
+static void place(struct wheel *w, struct timer *t)
+{
+	unsigned long delta = t->expires - w->now;
+	int level;
+
+	if (delta >= 1UL << (WHEEL_LEVELS * WHEEL_BITS)) {
+		/* Beyond the wheel. */
+		delta = (1UL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+		t->expires = w->now + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1UL << ((level + 1) * WHEEL_BITS))
+			break;
+
+	link_add_tail(&w->slots[level][(t->expires >> (level * WHEEL_BITS)) &
+		WHEEL_MASK], &t->link);
+}
+
+void timer_arm(struct wheel *w, struct timer *t, unsigned long expires_ns)
+{
+	unsigned long ticks;
+
+	timer_cancel(w, t);
+
+	/* Round up, and never fire in the current tick. */
+	ticks = expires_ns > w->start_ns
+		? (expires_ns - w->start_ns + w->tick_ns - 1) / w->tick_ns
+		: 0;
+	if (ticks <= w->now)
+		ticks = w->now + 1;
+	t->expires = ticks;
+	place(w, t);
+	w->count++;
+}
+
+void timer_cancel(struct wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+	link_del(&t->link);
+	w->count--;
+}
+
+/**
+ * cascade(): Place again the timers of the current slot of @level.
+ * Return true if the index of @level wrapped around too.
+ */
+static int cascade(struct wheel *w, int level)
+{
+	int idx = (w->now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+	struct timer_link list;
+
+	link_splice(&w->slots[level][idx], &list);
+	while (!link_empty(&list)) {
+		struct timer *t = (struct timer *)list.next;
+		link_del(&t->link);
+		place(w, t);
+	}
+	return idx == 0;
+}
+
+void wheel_advance(struct wheel *w, unsigned long now_ns)
+{
+	unsigned long target;
+
+	if (now_ns < w->start_ns)
+		return;
+	target = (now_ns - w->start_ns) / w->tick_ns;
+
+	while (w->now < target) {
+		struct timer_link expired;
+		int level;
+
+		w->now++;
+		if (!(w->now & WHEEL_MASK))
+			for (level = 1; level < WHEEL_LEVELS; level++)
+				if (!cascade(w, level))
+					break;
+
+		link_splice(&w->slots[0][w->now & WHEEL_MASK], &expired);
+		while (!link_empty(&expired)) {
+			struct timer *t = (struct timer *)expired.next;
+
+			link_del(&t->link);
+			w->count--;
+			assert(t->expires == w->now);
+			t->fn(t);
+		}
+	}
+}
+
+int wheel_timeout_ms(const struct wheel *w, unsigned long now_ns)
+{
+	unsigned long next_ns;
+
+	if (!w->count)
+		return -1;
+	next_ns = w->start_ns + (w->now + 1) * w->tick_ns;
+	if (next_ns <= now_ns)
+		return 0;
+	return (next_ns - now_ns + 999999) / 1000000;
+}
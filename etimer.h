@@ -0,0 +1,77 @@
+/*
+ * etimer.h
+ *
+ * A header file for the hierarchical timing wheel of the echo server.
+ *
+ */
+
+#ifndef _ECHO_TIMER_H
+#define _ECHO_TIMER_H
+
+#include <stddef.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+/* With WHEEL_BITS == 6, 4 levels cover 2^24 ticks, that is, over 46 hours
+ * with 10ms ticks. Timers further in the future are clamped to that.
+ */
+#define WHEEL_LEVELS	4
+
+struct timer_link {
+	struct timer_link	*next;
+	struct timer_link	*prev;
+};
+
+struct timer;
+typedef void (*timer_fn_t)(struct timer *t);
+
+struct timer {
+	/* Must be the first field. */
+	struct timer_link	link;
+	unsigned long		expires;	/* In ticks. */
+	timer_fn_t		fn;
+};
+
+/* Return the structure of type @type that embeds the timer @t in @member. */
+#define timer_entry(t, type, member) \
+	((type *)((char *)(t) - offsetof(type, member)))
+
+struct wheel {
+	unsigned long		tick_ns;
+	unsigned long		start_ns;
+	unsigned long		now;		/* Current tick. */
+	unsigned long		count;		/* Pending timers. */
+	struct timer_link	slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+/* @now_ns is the time of tick 0, see now_ns(). */
+void wheel_init(struct wheel *w, unsigned long tick_ns, unsigned long now_ns);
+
+void timer_init(struct timer *t, timer_fn_t fn);
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->link.next != NULL;
+}
+
+/* Arm @t to fire at @expires_ns, see now_ns(). If @t is pending, it is
+ * re-armed. Timers fire at the first tick at or after their expiration.
+ * O(1).
+ */
+void timer_arm(struct wheel *w, struct timer *t, unsigned long expires_ns);
+
+/* Disarm @t if it is pending. O(1). */
+void timer_cancel(struct wheel *w, struct timer *t);
+
+/* Advance the wheel to @now_ns, and call the functions of the timers that
+ * expire. These functions may arm and cancel any timer.
+ */
+void wheel_advance(struct wheel *w, unsigned long now_ns);
+
+/* Return how many milliseconds to wait before the next call to
+ * wheel_advance(), or -1 if no timer is pending.
+ */
+int wheel_timeout_ms(const struct wheel *w, unsigned long now_ns);
+
+#endif /* _ECHO_TIMER_H */
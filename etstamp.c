@@ -0,0 +1,226 @@
+/*
+ * etstamp.c
+ *
+ * This file implements the kernel timestamping support of the echo clients.
+ *
+ * A request is broken down in three parts that add up to the time measured
+ * in user space from the last send to the last receive:
+ *	user -> kernel send:	from the send call to the software TX
+ *				timestamp of the data;
+ *	kernel send -> recv:	from the TX timestamp to the software RX
+ *				timestamp of the echo;
+ *	kernel recv -> user:	from the RX timestamp to the return of
+ *				the receive call.
+ * All software timestamps are taken with CLOCK_REALTIME.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "eutils.h"
+#include "ehist.h"
+#include "etstamp.h"
+
+#define CONTROL_LEN 512
+
+/* Timestamps of the request in flight, 0 when unknown. */
+static struct {
+	unsigned long	user_send;
+	unsigned long	sched;
+	unsigned long	kernel_send;
+	unsigned long	ack;
+	unsigned long	kernel_recv;
+	unsigned long	user_recv;
+} cur;
+
+static struct hist to_kernel, in_kernel, to_user;
+static int n_requests;
+
+static inline unsigned long realtime_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline unsigned long ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000UL + ts->tv_nsec;
+}
+
+int tstamp_enable(int s, int is_stream)
+{
+	int flags = SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_RX_SOFTWARE |
+		SOF_TIMESTAMPING_TX_SOFTWARE |
+		SOF_TIMESTAMPING_OPT_ID |
+		SOF_TIMESTAMPING_OPT_TSONLY;
+
+	if (is_stream)
+		flags |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_ACK;
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		sizeof(flags))) {
+		fprintf(stderr, "%s: setsockopt errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+
+	hist_init(&to_kernel);
+	hist_init(&in_kernel);
+	hist_init(&to_user);
+	return 0;
+}
+
+void tstamp_sent(void)
+{
+	cur.user_send = realtime_ns();
+}
+
+/**
+ * find_tstamp(): Return the software timestamp in the control messages
+ * of @msg, or NULL if there is none. If @pinfo isn't NULL, it receives
+ * the type of the timestamp found in the error queue.
+ */
+static struct timespec *find_tstamp(struct msghdr *msg, int *pinfo)
+{
+	struct timespec *ts = NULL;
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+			cm->cmsg_type == SO_TIMESTAMPING) {
+			struct scm_timestamping *tss =
+				(struct scm_timestamping *)CMSG_DATA(cm);
+			ts = &tss->ts[0];
+		} else if (pinfo && (cm->cmsg_level == SOL_IP ||
+			cm->cmsg_level == SOL_IPV6)) {
+			struct sock_extended_err *serr =
+				(struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+				*pinfo = serr->ee_info;
+		}
+	}
+	return ts;
+}
+
+void tstamp_drain_tx(int s)
+{
+	while (1) {
+		char control[CONTROL_LEN];
+		struct msghdr msg;
+		struct timespec *ts;
+		int info = -1;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			return;
+		}
+
+		ts = find_tstamp(&msg, &info);
+		if (!ts)
+			continue;
+
+		/* Keep the timestamps of the last bytes sent. */
+		switch (info) {
+		case SCM_TSTAMP_SCHED:
+			cur.sched = ts_ns(ts);
+			break;
+		case SCM_TSTAMP_SND:
+			cur.kernel_send = ts_ns(ts);
+			break;
+		case SCM_TSTAMP_ACK:
+			cur.ack = ts_ns(ts);
+			break;
+		}
+	}
+}
+
+ssize_t tstamp_recv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *src, socklen_t *psrc_len)
+{
+	char control[CONTROL_LEN];
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg;
+	struct timespec *ts;
+	ssize_t rc;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = src;
+	msg.msg_namelen = psrc_len ? *psrc_len : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	rc = recvmsg(s, &msg, flags);
+	if (rc < 0)
+		return rc;
+
+	cur.user_recv = realtime_ns();
+	if (psrc_len)
+		*psrc_len = msg.msg_namelen;
+	ts = find_tstamp(&msg, NULL);
+	if (ts)
+		cur.kernel_recv = ts_ns(ts);
+	return rc;
+}
+
+static inline double delta_us(unsigned long from, unsigned long to)
+{
+	return ((double)to - (double)from) / 1e3;
+}
+
+void tstamp_report(int s, FILE *f)
+{
+	tstamp_drain_tx(s);
+	n_requests++;
+
+	if (!cur.user_send || !cur.kernel_send || !cur.kernel_recv ||
+		!cur.user_recv) {
+		fprintf(f, "tstamp: request %i: missing timestamps\n",
+			n_requests);
+		goto out;
+	}
+
+	fprintf(f, "tstamp: request %i: user->kernel send %.1fus, "
+		"kernel send->kernel recv %.1fus, kernel recv->user %.1fus",
+		n_requests, delta_us(cur.user_send, cur.kernel_send),
+		delta_us(cur.kernel_send, cur.kernel_recv),
+		delta_us(cur.kernel_recv, cur.user_recv));
+	if (cur.sched)
+		fprintf(f, ", sched->send %.1fus",
+			delta_us(cur.sched, cur.kernel_send));
+	if (cur.ack)
+		fprintf(f, ", send->ack %.1fus",
+			delta_us(cur.kernel_send, cur.ack));
+	fprintf(f, "\n");
+
+	/* Clocks may step, do not record negative deltas. */
+	if (cur.kernel_send >= cur.user_send)
+		hist_add(&to_kernel, cur.kernel_send - cur.user_send);
+	if (cur.kernel_recv >= cur.kernel_send)
+		hist_add(&in_kernel, cur.kernel_recv - cur.kernel_send);
+	if (cur.user_recv >= cur.kernel_recv)
+		hist_add(&to_user, cur.user_recv - cur.kernel_recv);
+
+out:
+	memset(&cur, 0, sizeof(cur));
+}
+
+void tstamp_summary(FILE *f)
+{
+	if (!n_requests)
+		return;
+	hist_print(f, "user->kernel send", &to_kernel);
+	hist_print(f, "kernel send->kernel recv", &in_kernel);
+	hist_print(f, "kernel recv->user", &to_user);
+}
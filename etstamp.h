@@ -0,0 +1,37 @@
+/*
+ * etstamp.h
+ *
+ * A header file for the kernel timestamping support of the echo clients.
+ *
+ */
+
+#ifndef _ECHO_TSTAMP_H
+#define _ECHO_TSTAMP_H
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+/* Enable software RX and TX timestamps on @s. Stream sockets also get
+ * SCHED and ACK timestamps. Return 0 on success.
+ */
+int tstamp_enable(int s, int is_stream);
+
+/* Record the user-space time right before a request is handed to
+ * the kernel.
+ */
+void tstamp_sent(void);
+
+/* Collect the TX timestamps queued on the error queue of @s. */
+void tstamp_drain_tx(int s);
+
+/* recvfrom() that also records the kernel RX timestamp of the data. */
+ssize_t tstamp_recv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *src, socklen_t *psrc_len);
+
+/* Print the breakdown of the last request, and add it to the summary. */
+void tstamp_report(int s, FILE *f);
+
+/* Print the distributions of all reported requests. */
+void tstamp_summary(FILE *f);
+
+#endif /* _ECHO_TSTAMP_H */
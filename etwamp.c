@@ -0,0 +1,143 @@
+/*
+ * etwamp.c
+ *
+ * This file implements the TWAMP-Light test packets of eserv -m twamp and
+ * ecli -t.
+ *
+ * Receive timestamps come from the kernel, taken in software as the
+ * datagram enters the stack. Send timestamps have to be in the packet
+ * before it is sent, so they are taken in user space right before the
+ * send call. All of them come from CLOCK_REALTIME, as NTP timestamps do.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/timex.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "etwamp.h"
+
+#define CONTROL_LEN	512
+
+/* Seconds from 1900, the NTP epoch, to 1970, the Unix one. */
+#define NTP_UNIX_OFFSET	2208988800UL
+#define NS_PER_SEC	1000000000UL
+
+uint64_t twamp_ntp(const struct timespec *ts)
+{
+	uint64_t frac = ((uint64_t)ts->tv_nsec << 32) / NS_PER_SEC;
+
+	return ((uint64_t)(ts->tv_sec + NTP_UNIX_OFFSET) << 32) | frac;
+}
+
+uint64_t twamp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return twamp_ntp(&ts);
+}
+
+uint64_t twamp_ntp_ns(uint64_t ntp)
+{
+	uint64_t secs = (ntp >> 32) - NTP_UNIX_OFFSET;
+
+	return secs * NS_PER_SEC + (((ntp & 0xffffffff) * NS_PER_SEC) >> 32);
+}
+
+uint16_t twamp_error_estimate(void)
+{
+	struct timex tx;
+	uint64_t err;
+	uint16_t scale = 0, sync;
+	int state;
+
+	memset(&tx, 0, sizeof(tx));
+	state = adjtimex(&tx);
+	sync = state >= 0 && state != TIME_ERROR && !(tx.status & STA_UNSYNC);
+
+	/* In units of 2^-32 seconds, rounded up, and at least one, since
+	 * the multiplier may not be 0.
+	 */
+	err = sync ? tx.esterror : tx.maxerror;
+	err = (err * 4294967296ULL + 999999) / 1000000;
+	if (!err)
+		err = 1;
+	while (err > 0xff && scale < 0x3f) {
+		err = (err + 1) >> 1;
+		scale++;
+	}
+	if (err > 0xff)
+		err = 0xff;
+	return (sync ? TWAMP_ERROR_SYNC : 0) | scale << 8 | err;
+}
+
+double twamp_error_seconds(uint16_t error)
+{
+	int scale = (error >> 8) & 0x3f;
+
+	return (error & 0xff) * (double)(1ULL << scale) / 4294967296.0;
+}
+
+int twamp_enable(int s, int ttl)
+{
+	int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE;
+	int one = 1;
+
+	if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		sizeof(flags)) || (ttl && setsockopt(s, IPPROTO_IP,
+		IP_RECVTTL, &one, sizeof(one)))) {
+		fprintf(stderr, "%s: setsockopt errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+ssize_t twamp_recv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *src, socklen_t *psrc_len, uint64_t *rx_ts,
+	uint8_t *ttl)
+{
+	char control[CONTROL_LEN];
+	struct iovec iov = {.iov_base = buf, .iov_len = len};
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	ssize_t rc;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = src;
+	msg.msg_namelen = psrc_len ? *psrc_len : 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	rc = recvmsg(s, &msg, flags);
+	if (rc < 0)
+		return rc;
+	if (psrc_len)
+		*psrc_len = msg.msg_namelen;
+
+	*rx_ts = 0;
+	if (ttl)
+		*ttl = 0;
+	for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET &&
+			cm->cmsg_type == SO_TIMESTAMPING) {
+			struct scm_timestamping *tss =
+				(struct scm_timestamping *)CMSG_DATA(cm);
+
+			*rx_ts = twamp_ntp(&tss->ts[0]);
+		} else if (ttl && cm->cmsg_level == IPPROTO_IP &&
+			cm->cmsg_type == IP_TTL) {
+			int value;
+
+			memcpy(&value, CMSG_DATA(cm), sizeof(value));
+			*ttl = value;
+		}
+	}
+	return rc;
+}
@@ -0,0 +1,79 @@
+/*
+ * etwamp.h
+ *
+ * A header file for the TWAMP-Light test packets of eserv -m twamp and
+ * ecli -t.
+ *
+ */
+
+#ifndef _ECHO_TWAMP_H
+#define _ECHO_TWAMP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* Unauthenticated test packets of RFC 5357, 4.1.2 and 4.2.1. Fields are
+ * in network byte order, and timestamps in the NTP format: seconds since
+ * 1900 in the high 32 bits, and the fraction of a second in the low ones.
+ * Padding follows both packets.
+ */
+struct twamp_test {
+	uint32_t	seq;
+	uint64_t	ts;		/* When the sender sent it. */
+	uint16_t	error;		/* Error estimate of @ts. */
+} __attribute__((packed));
+
+struct twamp_reflect {
+	uint32_t	seq;
+	uint64_t	ts;		/* When the reflector sent it. */
+	uint16_t	error;
+	uint16_t	mbz1;
+	uint64_t	rx_ts;		/* When the test packet arrived. */
+	uint32_t	sender_seq;	/* Copied from the test packet. */
+	uint64_t	sender_ts;
+	uint16_t	sender_error;
+	uint16_t	mbz2;
+	uint8_t		sender_ttl;	/* TTL of the test packet. */
+} __attribute__((packed));
+
+/* Bits of the error estimate. */
+#define TWAMP_ERROR_SYNC	0x8000	/* Clock synchronized to UTC. */
+#define TWAMP_ERROR_Z		0x4000	/* Timestamps are not NTP. */
+
+/* Test packets are at least as large as the reflected ones, so that the
+ * reflector answers with the size it receives.
+ */
+#define TWAMP_MIN_SIZE	((int)sizeof(struct twamp_reflect))
+
+/* Current CLOCK_REALTIME in the NTP format, host byte order. */
+uint64_t twamp_now(void);
+
+/* @ts in the NTP format, host byte order. */
+uint64_t twamp_ntp(const struct timespec *ts);
+
+/* Nanoseconds since the Unix epoch of the NTP timestamp @ntp, host byte
+ * order.
+ */
+uint64_t twamp_ntp_ns(uint64_t ntp);
+
+/* Error estimate of the local clock, host byte order, see adjtimex(2). */
+uint16_t twamp_error_estimate(void);
+
+/* Seconds of error of the estimate @error, host byte order. */
+double twamp_error_seconds(uint16_t error);
+
+/* Enable software RX timestamps on the IPv4 socket @s, and, if @ttl is
+ * true, reception of the TTL of datagrams. Return 0 on success.
+ */
+int twamp_enable(int s, int ttl);
+
+/* recvfrom() that also returns the kernel RX timestamp of the datagram in
+ * @rx_ts, NTP format in host byte order, and its TTL in @ttl if it is not
+ * NULL. Both are 0 if the kernel did not pass them.
+ */
+ssize_t twamp_recv(int s, void *buf, size_t len, int flags,
+	struct sockaddr *src, socklen_t *psrc_len, uint64_t *rx_ts,
+	uint8_t *ttl);
+
+#endif /* _ECHO_TWAMP_H */
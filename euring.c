@@ -0,0 +1,420 @@
+/*
+ * euring.c
+ *
+ * This file implements the io_uring engine of the datagram echo server.
+ * It talks to the kernel through the raw system calls, so it needs no
+ * library.
+ *
+ * A single multishot recvmsg() stays armed on the socket, and the kernel
+ * picks a buffer from a provided buffer ring for each datagram. The echo
+ * goes out from that same buffer with a sendmsg(), and the buffer returns
+ * to the ring once the send completes. All sends prepared while reaping
+ * completions are submitted together.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "eutils.h"
+#include "ehist.h"
+#include "estats.h"
+#include "epool.h"
+#include "euring.h"
+
+/* Must be powers of 2. There is at most one send per buffer, so the
+ * submission queue never fills up.
+ */
+#define URING_ENTRIES	256
+#define URING_BUFS	64
+
+/* Room for the header of the kernel, a source address, and the largest
+ * datagram.
+ */
+#define NAME_LEN	((int)sizeof(struct tmp_sockaddr_storage))
+#define PAYLOAD_OFF	(sizeof(struct io_uring_recvmsg_out) + NAME_LEN)
+#define URING_BUF_SIZE	((PAYLOAD_OFF + MAX_UDP + 4095) & ~4095UL)
+
+#define BGID		0
+#define RECV_TAG	(~0ULL)
+
+struct uring {
+	int			fd;
+	int			sqpoll;
+
+	/* Both rings, in a single mapping. */
+	void			*rings;
+	size_t			rings_len;
+	size_t			sqes_len;
+
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_flags;
+	unsigned int		*sq_array;
+	unsigned int		sq_mask;
+	unsigned int		tail;		/* SQEs prepared. */
+	unsigned int		submitted;	/* SQEs handed over. */
+	struct io_uring_sqe	*sqes;
+
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct io_uring_buf_ring *br;
+	char			*bufs;
+	int			free_bufs;
+	int			recv_armed;
+	struct msghdr		recv_msg;
+
+	/* The send of each buffer. */
+	struct {
+		struct msghdr	msg;
+		struct iovec	iov;
+		unsigned long	start;
+	} sends[URING_BUFS];
+};
+
+static _Atomic unsigned long enters, sqes_submitted, completions;
+static _Atomic unsigned long recv_rearms, recv_errors, send_errors;
+
+/**
+ * uring_unmap(): Undo what uring_map() and uring_buffers() set up.
+ */
+static void uring_unmap(struct uring *u)
+{
+	if (u->br)
+		munmap(u->br, URING_BUFS * sizeof(struct io_uring_buf));
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->rings)
+		munmap(u->rings, u->rings_len);
+	close(u->fd);
+}
+
+static inline int sys_io_uring_setup(unsigned int entries,
+	struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+	void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * uring_map(): Create the rings and map them. Return 0 on success.
+ */
+static int uring_map(struct uring *u, int sqpoll)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	/* Every buffer may have a receive and a send completion. */
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * URING_BUFS;
+	if (sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+	u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (u->fd < 0) {
+		fprintf(stderr, "%s: io_uring_setup errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		fprintf(stderr, "%s: the kernel is too old\n", __func__);
+		close(u->fd);
+		return -1;
+	}
+	u->sqpoll = sqpoll;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_len > sq_len)
+		sq_len = cq_len;
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	u->rings = cq = sq;
+	u->rings_len = sq_len;
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	u->tail = u->submitted = *u->sq_tail;
+
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+err:
+	fprintf(stderr, "%s: mmap errno=%i: %s\n", __func__, errno,
+		strerror(errno));
+	uring_unmap(u);
+	return -1;
+}
+
+/**
+ * put_buf(): Hand buffer @bid to the kernel again.
+ */
+static void put_buf(struct uring *u, int bid)
+{
+	unsigned short tail = u->br->tail;
+	struct io_uring_buf *b = &u->br->bufs[tail & (URING_BUFS - 1)];
+
+	b->addr = (unsigned long)(u->bufs + bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, tail + 1, __ATOMIC_RELEASE);
+	u->free_bufs++;
+}
+
+/**
+ * uring_buffers(): Register the ring of provided buffers, and fill it.
+ * Return 0 on success.
+ */
+static int uring_buffers(struct uring *u)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	u->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		fprintf(stderr, "%s: mmap errno=%i: %s\n", __func__, errno,
+			strerror(errno));
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = BGID;
+	if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		fprintf(stderr, "%s: IORING_REGISTER_PBUF_RING errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+
+	u->bufs = pool_get(URING_BUFS * URING_BUF_SIZE);
+	for (i = 0; i < URING_BUFS; i++)
+		put_buf(u, i);
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *u)
+{
+	unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+
+	assert(u->tail - head < URING_ENTRIES);
+	i = u->tail & u->sq_mask;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[i] = i;
+	u->tail++;
+	return sqe;
+}
+
+static void arm_recv(struct uring *u, int s)
+{
+	struct io_uring_sqe *sqe = get_sqe(u);
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = s;
+	sqe->addr = (unsigned long)&u->recv_msg;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = RECV_TAG;
+	u->recv_armed = 1;
+}
+
+/**
+ * echo(): Queue the echo of the datagram that the kernel placed in buffer
+ * @bid, from that same buffer.
+ */
+static void echo(struct uring *u, int s, int bid)
+{
+	char *buf = u->bufs + bid * URING_BUF_SIZE;
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+	struct io_uring_sqe *sqe;
+
+	/* Buffers fit the largest datagram and address. */
+	assert(!(out->flags & MSG_TRUNC));
+	assert(out->namelen <= NAME_LEN);
+
+	u->free_bufs--;
+	u->sends[bid].start = now_ns();
+	u->sends[bid].iov.iov_base = buf + PAYLOAD_OFF;
+	u->sends[bid].iov.iov_len = out->payloadlen;
+	memset(&u->sends[bid].msg, 0, sizeof(u->sends[bid].msg));
+	u->sends[bid].msg.msg_name = buf + sizeof(*out);
+	u->sends[bid].msg.msg_namelen = out->namelen;
+	u->sends[bid].msg.msg_iov = &u->sends[bid].iov;
+	u->sends[bid].msg.msg_iovlen = 1;
+
+	sqe = get_sqe(u);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s;
+	sqe->addr = (unsigned long)&u->sends[bid].msg;
+	sqe->user_data = bid;
+}
+
+/**
+ * reap(): Process all completions. Return how many there were.
+ */
+static unsigned int reap(struct uring *u, int s, struct hist *turnaround,
+	unsigned long *bytes)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned int n = tail - head;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+
+		if (cqe->user_data == RECV_TAG) {
+			/* Without F_MORE, the multishot request ended,
+			 * for example, because the buffers ran out.
+			 */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				u->recv_armed = 0;
+			/* Running out of buffers is expected, anything
+			 * else is counted, and the loop re-arms the
+			 * receive either way.
+			 */
+			if (cqe->res < 0) {
+				if (cqe->res != -ENOBUFS && cqe->res != -EINTR)
+					atomic_fetch_add_explicit(&recv_errors,
+						1, memory_order_relaxed);
+				continue;
+			}
+			assert(cqe->flags & IORING_CQE_F_BUFFER);
+			echo(u, s, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			continue;
+		}
+
+		if (cqe->res >= 0) {
+			hist_add(turnaround,
+				now_ns() - u->sends[cqe->user_data].start);
+			*bytes += cqe->res;
+		} else {
+			atomic_fetch_add_explicit(&send_errors, 1,
+				memory_order_relaxed);
+		}
+		put_buf(u, cqe->user_data);
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	atomic_fetch_add_explicit(&completions, n, memory_order_relaxed);
+	return n;
+}
+
+/**
+ * submit(): Hand the prepared SQEs to the kernel, and if @wait is true,
+ * wait for a completion.
+ */
+static void submit(struct uring *u, int wait)
+{
+	unsigned int to_submit = u->tail - u->submitted;
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	u->submitted = u->tail;
+	atomic_fetch_add_explicit(&sqes_submitted, to_submit,
+		memory_order_relaxed);
+
+	if (u->sqpoll) {
+		/* The kernel thread takes the SQEs, unless it went to
+		 * sleep, and the store of the tail must be visible before
+		 * its flag is read.
+		 */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+			IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		to_submit = 0;
+	}
+	if (!to_submit && !flags)
+		return;
+
+	atomic_fetch_add_explicit(&enters, 1, memory_order_relaxed);
+	while (sys_io_uring_enter(u->fd, to_submit, wait, flags) < 0)
+		assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+}
+
+/**
+ * uring_report(): Print how many completions each call to io_uring_enter()
+ * reaps.
+ */
+static void uring_report(FILE *f, void *arg)
+{
+	unsigned long e = atomic_load(&enters);
+	unsigned long c = atomic_load(&completions);
+
+	UNUSED(arg);
+	fprintf(f, "io_uring: %lu completions and %lu SQEs in %lu "
+		"io_uring_enter() calls, %.1f completions per call, "
+		"%lu receive re-arms, %lu failed receives, %lu failed "
+		"sends\n", c, atomic_load(&sqes_submitted), e,
+		e ? (double)c / e : 0.0, atomic_load(&recv_rearms),
+		atomic_load(&recv_errors), atomic_load(&send_errors));
+}
+
+int uring_datagram_loop(int s, int sqpoll, struct hist *turnaround,
+	unsigned long *bytes)
+{
+	static struct uring u;
+
+	memset(&u, 0, sizeof(u));
+	if (uring_map(&u, sqpoll))
+		return -1;
+	if (uring_buffers(&u)) {
+		uring_unmap(&u);
+		return -1;
+	}
+	/* The kernel only reads the lengths of the name and control data. */
+	u.recv_msg.msg_namelen = NAME_LEN;
+	stats_register(uring_report, NULL);
+
+	while (1) {
+		if (!u.recv_armed && u.free_bufs) {
+			atomic_fetch_add_explicit(&recv_rearms, 1,
+				memory_order_relaxed);
+			arm_recv(&u, s);
+		}
+		submit(&u, !reap(&u, s, turnaround, bytes));
+	}
+}
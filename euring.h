@@ -0,0 +1,28 @@
+/*
+ * euring.h
+ *
+ * A header file for the io_uring engine of the datagram echo server.
+ *
+ */
+
+#ifndef _ECHO_URING_H
+#define _ECHO_URING_H
+
+#include <stdio.h>
+
+struct hist;
+
+/* Echo the datagrams that arrive at @s through io_uring, with a multishot
+ * recvmsg() over a ring of provided buffers, and a sendmsg() per echo,
+ * all of them submitted in batches. If @sqpoll is true, a kernel thread
+ * polls the submission queue, so a busy server makes no system call.
+ * As the classic loop does, this records in @turnaround the time from
+ * the reception of each datagram until its echo is sent, and adds the
+ * bytes echoed to *@bytes. Once set up, it registers its own report of
+ * how many completions each call to io_uring_enter() reaps.
+ * This only returns if io_uring is not available, and then returns -1.
+ */
+int uring_datagram_loop(int s, int sqpoll, struct hist *turnaround,
+	unsigned long *bytes);
+
+#endif /* _ECHO_URING_H */
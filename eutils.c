@@ -14,23 +14,102 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "eutils.h"
+#include "ehist.h"
+#include "etstamp.h"
+#include "eprobe.h"
+#include "epool.h"
+#include "ezcopy.h"
 
 #define FILE_APPENDIX "_echo"
 
+/* Size of the buffer of copy_data(). */
+#define COPY_BUF_SIZE 2048
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+struct echo_opts eopts;
+unsigned long echoes, echoed_bytes;
+
+/* Outcomes of busy_spin(). */
+static _Atomic unsigned long spin_ready, spin_missed;
+
+void shift_options(int *pargc, char ***pargv)
+{
+	char **argv = *pargv;
+
+	argv[optind - 1] = argv[0];
+	*pargv = argv + optind - 1;
+	*pargc -= optind - 1;
+}
+
 /**
  * check_cli_params(): Ensure that the correct number of arguments have been
  * given.
  */
-int check_cli_params(int *pis_stream, int argc, char * const argv[])
+int check_cli_params(int *pis_stream, int *pargc, char ***pargv)
 {
-	int is_xia;
+	int argc, opt, is_xia = 0;
+	char **argv;
+
+	while ((opt = getopt(*pargc, *pargv, "TPHzRB:")) != -1) {
+		switch (opt) {
+		case 'B': {
+			char *end;
+
+			eopts.busy_poll = strtol(optarg, &end, 0);
+			if (*end || eopts.busy_poll < 0) {
+				argc = 0;
+				argv = *pargv;
+				goto failure;
+			}
+			break;
+		}
+		case 'T':
+			eopts.tstamp = 1;
+			break;
+		case 'P':
+			eopts.perf = 1;
+			break;
+		case 'H':
+			eopts.huge = 1;
+			break;
+		case 'z':
+			eopts.zerocopy = 1;
+			break;
+		case 'R':
+			eopts.rx_zerocopy = 1;
+			break;
+		default:
+			argc = 0;
+			argv = *pargv;
+			goto failure;
+		}
+	}
+	shift_options(pargc, pargv);
+	argc = *pargc;
+	argv = *pargv;
+
+	/* Both share the error queue of the socket. */
+	if (eopts.tstamp && eopts.zerocopy) {
+		printf("Options -T and -z cannot be combined.\n");
+		exit(1);
+	}
 
 	if (argc > 1) {
 		if (!strcmp(argv[1], "datagram"))
@@ -55,10 +134,18 @@ int check_cli_params(int *pis_stream, int argc, char * const argv[])
 		return is_xia;
 
 failure:
-	printf("usage:\t%s <'datagram' | 'stream'> 'ip' srvip_addr port\n",
-		argv[0]);
-	printf(      "\t%s <'datagram' | 'stream'> 'xip' cli_addr_file srv_addr_file\n",
-		argv[0]);
+	printf("usage:\t%s [options] <'datagram' | 'stream'> 'ip' "
+		"srvip_addr port\n", argv[0]);
+	printf("\t%s [options] <'datagram' | 'stream'> 'xip' "
+		"cli_addr_file srv_addr_file\n", argv[0]);
+	printf("options:\n"
+		"\t-T\treport kernel timestamps of each request\n"
+		"\t-P\treport performance counters per echo\n"
+		"\t-H\tback buffers with hugepages, prefault and pin them\n"
+		"\t-z\tsend files with MSG_ZEROCOPY\n"
+		"\t-R\treceive file echoes with TCP_ZEROCOPY_RECEIVE (stream)\n"
+		"\t-B us\tspin up to us microseconds on the socket before "
+		"blocking\n");
 	exit(1);
 }
 
@@ -113,9 +200,72 @@ int any_socket(int is_xia, int is_stream)
 		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
 	}
 
+	if (eopts.busy_poll && sock >= 0) {
+		/* Blocking reads poll the device queue for up to the budget
+		 * before sleeping, and the device should defer interrupts
+		 * to busy polling. Both are optional, since raising
+		 * SO_BUSY_POLL over net.core.busy_read takes CAP_NET_ADMIN,
+		 * and SO_PREFER_BUSY_POLL requires Linux 5.11.
+		 * Accepted sockets inherit both.
+		 */
+		int one = 1;
+
+		if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+			&eopts.busy_poll, sizeof(eopts.busy_poll)))
+			fprintf(stderr, "%s: SO_BUSY_POLL errno=%i: %s\n",
+				__func__, errno, strerror(errno));
+		setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+			sizeof(one));
+	}
+
 	return sock;
 }
 
+short busy_spin(int fd, short events)
+{
+	struct pollfd pfd = {.fd = fd, .events = events};
+	unsigned long deadline;
+
+	if (!eopts.busy_poll)
+		return 0;
+
+	deadline = now_ns() + eopts.busy_poll * 1000UL;
+	do {
+		int rc = poll(&pfd, 1, 0);
+
+		assert(rc >= 0 || errno == EINTR);
+		if (rc > 0) {
+			atomic_fetch_add_explicit(&spin_ready, 1,
+				memory_order_relaxed);
+			return pfd.revents;
+		}
+	} while (now_ns() < deadline);
+
+	atomic_fetch_add_explicit(&spin_missed, 1, memory_order_relaxed);
+	return 0;
+}
+
+int busy_poll_wait(struct pollfd *pfd, int timeout_ms)
+{
+	pfd->revents = busy_spin(pfd->fd, pfd->events);
+	if (pfd->revents)
+		return 1;
+	return poll(pfd, 1, timeout_ms);
+}
+
+void busy_poll_report(FILE *f, void *arg)
+{
+	struct rusage ru;
+
+	UNUSED(arg);
+	assert(!getrusage(RUSAGE_SELF, &ru));
+	fprintf(f, "busy poll: budget %ius, ready %lu times while spinning, "
+		"%lu fell back to blocking, %.2fs CPU\n", eopts.busy_poll,
+		atomic_load(&spin_ready), atomic_load(&spin_missed),
+		ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+}
+
 static void set_sockaddr_in(struct sockaddr_in *in, char *str_addr, int port)
 {
 	in->sin_family = AF_INET;
@@ -235,6 +385,50 @@ void any_bind(int is_xia, int force, int s, const struct sockaddr *addr,
 	}
 }
 
+/**
+ * mix(): Finalizer of MurmurHash3, spreads the bits of @h over the result.
+ */
+static inline uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t addr_hash(const struct sockaddr *addr, socklen_t len,
+	int with_port)
+{
+	const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+	const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+	const unsigned char *p = (const unsigned char *)addr;
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	socklen_t i;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		h = in->sin_addr.s_addr | (uint64_t)AF_INET << 48;
+		if (with_port)
+			h |= (uint64_t)in->sin_port << 32;
+		h = mix(h);
+		return h ? h : 1;
+	case AF_INET6:
+		p = in6->sin6_addr.s6_addr;
+		len = sizeof(in6->sin6_addr);
+		if (with_port)
+			h ^= in6->sin6_port;
+		break;
+	}
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	h = mix(h);
+	return h ? h : 1;
+}
+
 int read_command(char *buf, int len)
 {
 	size_t n_read;
@@ -281,7 +475,12 @@ int read_command(char *buf, int len)
 void send_packet(int s, const char *buf, int n, const struct sockaddr *dst,
 	socklen_t dst_len)
 {
-	ssize_t rc = sendto(s, buf, n, 0, dst, dst_len);
+	ssize_t rc;
+
+	if (eopts.tstamp)
+		tstamp_sent();
+	rc = sendto(s, buf, n, 0, dst, dst_len);
+	EPROBE3(send, s, n, rc);
 	if (rc < 0) {
 		fprintf(stderr, "%s: sendto errno=%i: %s\n",
 			__func__, errno, strerror(errno));
@@ -289,6 +488,16 @@ void send_packet(int s, const char *buf, int n, const struct sockaddr *dst,
 	}
 }
 
+/**
+ * stream_send(): Write a whole buffer to the given stream socket.
+ */
+void stream_send(int s, const char *buf, int n)
+{
+	if (eopts.tstamp)
+		tstamp_sent();
+	assert(write(s, buf, n) == n);
+}
+
 static int count_rows(const struct sockaddr_xia *xia)
 {
 	int i;
@@ -340,52 +549,124 @@ void recv_write(int s, const struct sockaddr *expected_src,
 	unsigned int len;
 	int rc, n_read;
 
+	/* A datagram never exceeds POOL_MAX_SIZE. */
+	if (n_sent > POOL_MAX_SIZE)
+		n_sent = POOL_MAX_SIZE;
+	out = pool_get(n_sent);
+
+again:
 	/* Is there anything to read? */
 	FD_ZERO(&readfds);
 	FD_SET(s, &readfds);
-	rc = select(s + 1, &readfds, NULL, NULL, &timeout);
+	rc = busy_spin(s, POLLIN) ? 1
+		: select(s + 1, &readfds, NULL, NULL, &timeout);
 	assert(rc >= 0);
 	if (!rc) {
 		/* A packet was dropped. */
+		EPROBE2(recv_timeout, s, n_sent);
 		fprintf(stderr, ".");
+		pool_put(out);
 		return;
 	}
 
 	/* Read. */
-	out = alloca(n_sent);
 	len = sizeof(src);
-	n_read = recvfrom(s, out, n_sent, 0, (struct sockaddr *)&src, &len);
+	if (eopts.tstamp) {
+		/* TX timestamps in the error queue also wake select() up,
+		 * and select() leaves in @timeout the time remaining.
+		 */
+		tstamp_drain_tx(s);
+		n_read = tstamp_recv(s, out, n_sent, MSG_DONTWAIT,
+			(struct sockaddr *)&src, &len);
+		if (n_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			goto again;
+	} else {
+		n_read = recvfrom(s, out, n_sent, 0, (struct sockaddr *)&src,
+			&len);
+	}
 	assert(n_read >= 0);
 
 	/* Make sure that we're reading from the server. */
 	assert(address_match((struct sockaddr *)&src, len,
 		expected_src, exp_src_len));
 
+	if (eopts.tstamp)
+		tstamp_report(s, stderr);
+	echoes++;
+	echoed_bytes += n_read;
+
 	/* Write. */
 	fwrite(out, sizeof(char), n_read, copy);
+	pool_put(out);
+}
+
+static struct zc_rx cli_zc_rx = {.fd = -1};
+
+/**
+ * read_write_zc(): read_write() for eopts.rx_zerocopy, the echo is mapped
+ * instead of copied when possible.
+ */
+static void read_write_zc(int s, FILE *copy, int n_sent)
+{
+	if (cli_zc_rx.fd != s && zc_rx_init(&cli_zc_rx, s))
+		exit(1);
+
+	if ((int)zc_rx_read_write(&cli_zc_rx, copy, n_sent) < n_sent) {
+		/* The connection was closed or an error occorred. */
+		fprintf(stderr, ".");
+		return;
+	}
+	echoes++;
+	echoed_bytes += n_sent;
 }
 
+void read_write_zc_end(void)
+{
+	zc_rx_end(&cli_zc_rx);
+}
+
+/**
+ * read_write(): Read the echo of @n_sent bytes from the given stream socket
+ * and write it to the given file. @n_sent is unbounded, so the echo is
+ * copied through a buffer of at most POOL_MAX_SIZE bytes.
+ */
 void read_write(int s, FILE *copy, int n_sent)
 {
-	char *out;
-	int n_read;
+	int buf_len = n_sent < POOL_MAX_SIZE ? n_sent : POOL_MAX_SIZE;
+	char *out = pool_get(buf_len);
+	int n_read = 0;
 
-	/* Read. */
-	out = alloca(n_sent);
-	n_read = 0;
 	while (n_sent > n_read) {
-		int len = read(s, out + n_read, n_sent - n_read);
+		int want = n_sent - n_read;
+		int len;
+
+		if (want > buf_len)
+			want = buf_len;
+
+		/* Whether or not it finds data, a blocking read follows. */
+		busy_spin(s, POLLIN);
+		len = eopts.tstamp
+			? tstamp_recv(s, out, want, 0, NULL, NULL)
+			: read(s, out, want);
 		if (len <= 0) {
 			/* The connection was closed or an error occorred. */
 			fprintf(stderr, ".");
-			return;
+			goto out;
 		}
 		n_read += len;
+
+		/* Write. */
+		fwrite(out, sizeof(char), len, copy);
 	}
 	assert(n_read == n_sent);
 
-	/* Write. */
-	fwrite(out, sizeof(char), n_read, copy);
+	if (eopts.tstamp)
+		tstamp_report(s, stderr);
+	echoes++;
+	echoed_bytes += n_read;
+
+out:
+	pool_put(out);
 }
 
 /**
@@ -402,6 +683,18 @@ static FILE *fopen_copy(const char *orig_name, const char *mode)
 	return fopen(copy_name, mode);
 }
 
+static struct zc_socket cli_zc = {.fd = -1};
+
+/**
+ * zc_socket_of(): Return the zero-copy state of the client socket @s.
+ */
+static struct zc_socket *zc_socket_of(int s)
+{
+	if (cli_zc.fd != s && zc_init(&cli_zc, s))
+		exit(1);
+	return &cli_zc;
+}
+
 /**
  * process_file(): Set up the output file, read in the file into a char buffer,
  * and call __process_file() to do a sequence of sends and receives.
@@ -418,13 +711,20 @@ void datagram_process_file(int s, const struct sockaddr *srv, socklen_t srv_len,
 	copy = fopen_copy(orig_name, "wb");
 	assert(copy);
 
-	buf = alloca(chunk_size);
+	buf = pool_get(chunk_size);
 	count = bytes_sent = 0;
 	do {
 		size_t bytes_read = fread(buf, 1, chunk_size, orig);
 		assert(!ferror(orig));
 		if (bytes_read > 0) {
-			send_packet(s, buf, bytes_read, srv, srv_len);
+			if (eopts.zerocopy) {
+				/* The buffer is released on completion. */
+				assert(zc_send(zc_socket_of(s), buf, bytes_read,
+					srv, srv_len) == (ssize_t)bytes_read);
+				buf = pool_get(chunk_size);
+			} else {
+				send_packet(s, buf, bytes_read, srv, srv_len);
+			}
 			count++;
 			bytes_sent += bytes_read;
 		}
@@ -442,6 +742,9 @@ void datagram_process_file(int s, const struct sockaddr *srv, socklen_t srv_len,
 		recv_write(s, srv, srv_len, copy, bytes_sent);
 	}
 
+	pool_put(buf);
+	if (eopts.zerocopy)
+		zc_flush(zc_socket_of(s));
 	assert(!fclose(copy));
 	assert(!fclose(orig));
 }
@@ -458,21 +761,30 @@ void stream_process_file(int s, const char *orig_name, int chunk_size,
 	copy = fopen_copy(orig_name, "wb");
 	assert(copy);
 
-	buf = alloca(chunk_size);
+	buf = pool_get(chunk_size);
 	count = bytes_sent = 0;
 	do {
 		size_t bytes_read = fread(buf, 1, chunk_size, orig);
 		assert(!ferror(orig));
 		if (bytes_read > 0) {
-			assert(write(s, buf, bytes_read) ==
-				(ssize_t)bytes_read);
+			if (eopts.zerocopy) {
+				/* The buffer is released on completion. */
+				assert(zc_send(zc_socket_of(s), buf, bytes_read,
+					NULL, 0) == (ssize_t)bytes_read);
+				buf = pool_get(chunk_size);
+			} else {
+				stream_send(s, buf, bytes_read);
+			}
 			count++;
 			bytes_sent += bytes_read;
 		}
 		if (count == times) {
 			if (f)
 				f(s);
-			read_write(s, copy, bytes_sent);
+			if (eopts.rx_zerocopy)
+				read_write_zc(s, copy, bytes_sent);
+			else
+				read_write(s, copy, bytes_sent);
 			count = bytes_sent = 0;
 		}
 	} while (!feof(orig));
@@ -480,24 +792,457 @@ void stream_process_file(int s, const char *orig_name, int chunk_size,
 	if (count) {
 		if (f)
 			f(s);
-		read_write(s, copy, bytes_sent);
+		if (eopts.rx_zerocopy)
+			read_write_zc(s, copy, bytes_sent);
+		else
+			read_write(s, copy, bytes_sent);
 	}
 
+	pool_put(buf);
+	if (eopts.zerocopy)
+		zc_flush(zc_socket_of(s));
 	assert(!fclose(copy));
 	assert(!fclose(orig));
 }
 
-/* Copies data from file descriptor @from to file descriptor
- * @to until nothing is left to be copied. Exits if an error
- * occurs. This assumes both @from and @to are set for blocking
- * reads and writes.
+void copy_init(struct copy_state *c, int from, int to, int bulk)
+{
+	memset(c, 0, sizeof(*c));
+	c->from = from;
+	c->to = to;
+	c->buf_size = eopts.zerocopy || bulk ? POOL_MAX_SIZE : COPY_BUF_SIZE;
+	c->buf = pool_get(c->buf_size);
+	if (eopts.zerocopy) {
+		c->zc = malloc(sizeof(*c->zc));
+		assert(c->zc);
+		if (zc_init(c->zc, to)) {
+			free(c->zc);
+			c->zc = NULL;
+		}
+	}
+}
+
+/**
+ * write_pending(): Write what is left of the buffer of @c to its socket.
+ * Return 0 once all of it is written, or one of COPY_BLOCKED,
+ * COPY_ZC_WAIT, and COPY_EOF if the peer is gone.
+ */
+static int write_pending(struct copy_state *c, struct hist *turnaround)
+{
+	if (!c->len)
+		return 0;
+
+	while (c->written < c->len) {
+		ssize_t rc = c->zc
+			? zc_send_nb(c->zc, c->buf + c->written,
+				c->len - c->written)
+			: send(c->to, c->buf + c->written, c->len - c->written,
+				MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPY_BLOCKED;
+			if (errno == ENOBUFS && c->zc)
+				return COPY_ZC_WAIT;
+			/* The peer is gone, or its path is. */
+			return COPY_EOF;
+		}
+		c->written += rc;
+		if (c->written < c->len)
+			EPROBE4(partial_io, c->to, c->len, c->written, 1);
+	}
+
+	if (turnaround)
+		hist_add(turnaround, now_ns() - c->start);
+	c->copied += c->len;
+	if (c->zc) {
+		/* The kernel may still read @buf. */
+		zc_release(c->zc, c->buf);
+		c->buf = pool_get(c->buf_size);
+	}
+	c->len = c->written = 0;
+	return 0;
+}
+
+/* Copies data from file descriptor @from to socket @to
+ * until either of them would block, or nothing is left to be copied.
+ * An error of either descriptor, such as a reset or a timeout of the
+ * peer, ends the copy as EOF does. The descriptors are meant to be
+ * non-blocking, and this to be called again once what it returned is
+ * ready, see the COPY_* values.
+ * If @turnaround isn't NULL, the time from the return of each read
+ * until its data is fully written back is recorded in it.
+ * If @deficit isn't NULL, at most *@deficit bytes are read, and what is
+ * read is taken from it; once nothing is left, this returns COPY_YIELD.
+ * With zero-copy, reads are large enough to reach ZC_THRESHOLD, and
+ * every buffer written goes back to the pool once the kernel is done
+ * with it; the copy only reaches COPY_EOF after all of them are.
+ */
+int copy_data(struct copy_state *c, struct hist *turnaround, long *deficit)
+{
+	int rc = write_pending(c, turnaround);
+
+	if (rc)
+		return rc;
+
+	while (!c->eof) {
+		int want = c->buf_size;
+		ssize_t amount;
+
+		if (deficit) {
+			if (*deficit <= 0)
+				return COPY_YIELD;
+			if (*deficit < want)
+				want = *deficit;
+		}
+
+		amount = read(c->from, c->buf, want);
+
+		if (amount < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPY_AGAIN;
+			/* Any error ends the copy as EOF does. */
+			amount = 0;
+		}
+		if (!amount) {
+			c->eof = 1;
+			break;
+		}
+
+		c->start = now_ns();
+		if (amount < want)
+			EPROBE4(partial_io, c->from, want, amount, 0);
+		if (deficit)
+			*deficit -= amount;
+		c->len = amount;
+		rc = write_pending(c, turnaround);
+		if (rc)
+			return rc;
+	}
+
+	if (c->zc) {
+		zc_reap(c->zc, 0);
+		if (zc_in_flight(c->zc))
+			return COPY_ZC_WAIT;
+	}
+	return COPY_EOF;
+}
+
+/**
+ * read_ready(): Read what is ready on @c->from into @c->buf, up to
+ * @deficit bytes if it is not NULL. Return COPY_AGAIN once nothing is
+ * ready, COPY_YIELD once the deficit runs out, or COPY_EOF.
  */
-void copy_data(int from, int to)
+static int read_ready(struct copy_state *c, long *deficit)
+{
+	while (1) {
+		int want = c->buf_size;
+		ssize_t amount;
+
+		if (deficit) {
+			if (*deficit <= 0)
+				return COPY_YIELD;
+			if (*deficit < want)
+				want = *deficit;
+		}
+
+		amount = read(c->from, c->buf, want);
+		if (amount < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPY_AGAIN;
+			amount = 0;
+		}
+		if (!amount) {
+			c->eof = 1;
+			return COPY_EOF;
+		}
+		if (deficit)
+			*deficit -= amount;
+		c->copied += amount;
+	}
+}
+
+int discard_data(struct copy_state *c, long *deficit)
+{
+	return read_ready(c, deficit);
+}
+
+int source_data(struct copy_state *c, long *deficit)
 {
-	char buf[2048];
+	const char *p = pattern();
+	int rc = COPY_AGAIN, want = c->buf_size;
 	ssize_t amount;
 
-	while ((amount = read(from, buf, sizeof(buf))) > 0)
-		assert(write(to, buf, amount) == amount);
-	assert(amount >= 0);
+	/* Input gets a single read per turn, of up to what the pattern may
+	 * take, and outside the deficit. So each direction of a bidir peer
+	 * moves up to a quantum per turn, and neither starves the other.
+	 */
+	if (deficit) {
+		if (*deficit <= 0)
+			return COPY_YIELD;
+		if (*deficit < want)
+			want = *deficit;
+	}
+	amount = read(c->from, c->buf, want);
+	if (amount < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		amount = 0;
+	if (!amount) {
+		c->eof = 1;
+		rc = COPY_EOF;
+	} else if (amount > 0) {
+		c->received += amount;
+	}
+
+	while (rc != COPY_EOF) {
+		/* @c->written is the offset in the pattern. */
+		int want = PATTERN_SIZE - c->written;
+		ssize_t amount;
+
+		if (deficit) {
+			if (*deficit <= 0)
+				return COPY_YIELD;
+			if (*deficit < want)
+				want = *deficit;
+		}
+
+		amount = c->zc ? zc_send_nb(c->zc, p + c->written, want) :
+			send(c->to, p + c->written, want,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (amount < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPY_BLOCKED;
+			if (errno == ENOBUFS && c->zc)
+				return COPY_ZC_WAIT;
+			break;
+		}
+		if (deficit)
+			*deficit -= amount;
+		c->copied += amount;
+		c->written = (c->written + amount) % PATTERN_SIZE;
+	}
+
+	if (c->zc) {
+		zc_reap(c->zc, 0);
+		if (zc_in_flight(c->zc))
+			return COPY_ZC_WAIT;
+	}
+	return COPY_EOF;
+}
+
+/**
+ * rpc_send(): Send what is left of the response of @c: its header, then
+ * as much of the pattern as it asks for. The header changes with each
+ * request, so it is always copied; only the pattern goes out zero-copy.
+ * Return 0 once all of the response is sent, or one of COPY_BLOCKED,
+ * COPY_ZC_WAIT, COPY_YIELD, and COPY_EOF if the peer is gone, none of
+ * which is 0, so that rpc_data() stops at once.
+ */
+static int rpc_send(struct copy_state *c, long *deficit)
+{
+	const char *p = pattern();
+	const uint32_t hdr = sizeof(c->resp);
+
+	while (c->resp_sent < c->resp_len) {
+		uint32_t body = c->resp_sent > hdr ? c->resp_sent - hdr : 0;
+		uint32_t off = body % PATTERN_SIZE;
+		size_t chunk = PATTERN_SIZE - off;
+		ssize_t amount;
+
+		if (deficit) {
+			if (*deficit <= 0)
+				return COPY_YIELD;
+			if (*deficit < (long)chunk)
+				chunk = *deficit;
+		}
+		if (chunk > c->resp_len - hdr - body)
+			chunk = c->resp_len - hdr - body;
+
+		if (c->resp_sent < hdr) {
+			struct iovec iov[2] = {
+				{(char *)&c->resp + c->resp_sent,
+					hdr - c->resp_sent},
+				{(void *)p, c->zc ? 0 : chunk},
+			};
+			struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2};
+
+			amount = sendmsg(c->to, &msg, MSG_DONTWAIT |
+				MSG_NOSIGNAL | (c->zc && chunk ? MSG_MORE : 0));
+		} else if (c->zc) {
+			amount = zc_send_nb(c->zc, p + off, chunk);
+		} else {
+			amount = send(c->to, p + off, chunk,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		if (amount < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return COPY_BLOCKED;
+			if (errno == ENOBUFS && c->zc)
+				return COPY_ZC_WAIT;
+			c->eof = 1;
+			return COPY_EOF;
+		}
+		if (deficit)
+			*deficit -= amount;
+		c->copied += amount;
+		c->resp_sent += amount;
+	}
+	return 0;
+}
+
+/**
+ * rpc_parse(): Parse the requests in the buffer of @c up to the end of
+ * the first whole one, whose response is then pending.
+ * Return -1 if a request is malformed.
+ */
+static int rpc_parse(struct copy_state *c)
+{
+	while (c->written < c->len && !c->resp_len) {
+		uint32_t take, left = c->len - c->written;
+
+		if (c->req_got < sizeof(c->req)) {
+			take = sizeof(c->req) - c->req_got;
+			if (take > left)
+				take = left;
+			memcpy((char *)&c->req + c->req_got,
+				c->buf + c->written, take);
+			c->req_got += take;
+			c->written += take;
+			left -= take;
+			if (c->req_got < sizeof(c->req))
+				break;
+			take = be32toh(c->req.frame.len);
+			if (take < sizeof(c->req))
+				return -1;
+			c->req_left = take - sizeof(c->req);
+		}
+
+		take = c->req_left < left ? c->req_left : left;
+		c->written += take;
+		c->req_left -= take;
+		if (c->req_left)
+			break;
+
+		/* The request is whole. */
+		c->resp_len = be32toh(c->req.resp_len);
+		if (c->resp_len < sizeof(c->resp))
+			c->resp_len = sizeof(c->resp);
+		c->resp.len = htobe32(c->resp_len);
+		c->resp.id = c->req.frame.id;
+		c->resp.ts = c->req.frame.ts;
+		c->resp_sent = 0;
+		c->req_got = 0;
+		c->start = now_ns();
+	}
+	return 0;
+}
+
+int rpc_data(struct copy_state *c, struct hist *turnaround, long *deficit)
+{
+	int rc;
+
+	while (1) {
+		if (c->resp_len) {
+			/* A response that did not go out is not timed. */
+			rc = rpc_send(c, deficit);
+			if (rc)
+				return rc;
+			hist_add(turnaround, now_ns() - c->start);
+			c->resp_len = 0;
+		}
+
+		if (c->written == c->len) {
+			int want = c->buf_size;
+			ssize_t amount;
+
+			if (c->eof)
+				break;
+			if (deficit) {
+				if (*deficit <= 0)
+					return COPY_YIELD;
+				if (*deficit < want)
+					want = *deficit;
+			}
+			amount = read(c->from, c->buf, want);
+			if (amount < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return COPY_AGAIN;
+				amount = 0;
+			}
+			c->len = amount;
+			c->written = 0;
+			if (!amount) {
+				c->eof = 1;
+				break;
+			}
+			if (deficit)
+				*deficit -= amount;
+		}
+
+		if (rpc_parse(c)) {
+			c->eof = 1;
+			c->len = c->written = 0;
+			break;
+		}
+	}
+
+	if (c->zc) {
+		zc_reap(c->zc, 0);
+		if (zc_in_flight(c->zc))
+			return COPY_ZC_WAIT;
+	}
+	return COPY_EOF;
+}
+
+static char *pattern_buf;
+static pthread_once_t pattern_once = PTHREAD_ONCE_INIT;
+
+static void pattern_init(void)
+{
+	int i;
+
+	pattern_buf = pool_get(PATTERN_SIZE);
+	for (i = 0; i < PATTERN_SIZE; i++) {
+		int line = i / PATTERN_LINE, col = i % PATTERN_LINE;
+
+		if (col == PATTERN_LINE - 2)
+			pattern_buf[i] = '\r';
+		else if (col == PATTERN_LINE - 1)
+			pattern_buf[i] = '\n';
+		else
+			pattern_buf[i] = ' ' + (line + col) % 95;
+	}
+}
+
+const char *pattern(void)
+{
+	assert(!pthread_once(&pattern_once, pattern_init));
+	return pattern_buf;
+}
+
+const char *mode_names[MODES] = {
+	[MODE_ECHO]	= "echo",
+	[MODE_DISCARD]	= "discard",
+	[MODE_SOURCE]	= "source",
+	[MODE_RPC]	= "rpc",
+	[MODE_BIDIR]	= "bidir",
+	[MODE_TWAMP]	= "twamp",
+};
+
+int parse_mode(const char *name)
+{
+	int i;
+
+	for (i = 0; i < MODES; i++)
+		if (!strcmp(name, mode_names[i]))
+			return i;
+	return -1;
+}
+
+unsigned long copy_end(struct copy_state *c, int wait_ms)
+{
+	if (c->zc) {
+		zc_end(c->zc, wait_ms);
+		free(c->zc);
+	}
+	pool_put(c->buf);
+	return c->copied;
 }
@@ -12,8 +12,11 @@
 #define _ECHO_UTILS_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <xia_socket.h>
+#include "eframe.h"
 
 #define UNUSED(x) (void)x
 
@@ -36,6 +39,14 @@ struct tmp_sockaddr_storage {
  */
 #define MAX_UDP (0xffff - 8 - 20 - 14)
 
+/* Monotonic time in nanoseconds. */
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
 static inline int is_file(const char *x)
 {
 	return	(x[0] == '-') &&
@@ -43,9 +54,66 @@ static inline int is_file(const char *x)
 		(x[2] == ' ');
 }
 
+static inline int is_pipeline(const char *x)
+{
+	return	(x[0] == '-') &&
+		(x[1] == 'p') &&
+		(x[2] == ' ');
+}
+
+static inline int is_twamp(const char *x)
+{
+	return	(x[0] == '-') &&
+		(x[1] == 't') &&
+		(x[2] == ' ');
+}
+
 int any_socket(int is_xia, int is_stream);
 
-int check_cli_params(int *pis_stream, int argc, char * const argv[]);
+/* Options shared by the echo clients and server. Each program sets
+ * the fields it supports while parsing its command line.
+ */
+struct echo_opts {
+	int	tstamp;		/* Report kernel timestamps of requests. */
+	int	perf;		/* Report performance counters. */
+	int	huge;		/* Hugepage-backed, pinned buffers. */
+	int	zerocopy;	/* MSG_ZEROCOPY for large sends. */
+	int	rx_zerocopy;	/* TCP_ZEROCOPY_RECEIVE for bulk reads. */
+	int	busy_poll;	/* Spin budget in microseconds, 0 sleeps. */
+};
+
+extern struct echo_opts eopts;
+
+/* Echoes received by recv_write() and read_write(). */
+extern unsigned long echoes, echoed_bytes;
+
+/* Move the program name right before the positional parameters that
+ * getopt() left at the end of *@pargv, and make *@pargv and *@pargc only
+ * cover them.
+ */
+void shift_options(int *pargc, char ***pargv);
+
+struct pollfd;
+
+/* Spin on @fd until any of @events is ready or the budget of
+ * eopts.busy_poll runs out. Return the ready events, or 0 once the caller
+ * should fall back to blocking.
+ */
+short busy_spin(int fd, short events);
+
+/* poll() on a single descriptor, spinning first with busy_spin(). */
+int busy_poll_wait(struct pollfd *pfd, int timeout_ms);
+
+/* Print how often spinning found the socket ready, and the CPU time of
+ * the process, which spinning spends instead of sleeping.
+ */
+void busy_poll_report(FILE *f, void *arg);
+
+/* Parse the options and the positional parameters of the clients.
+ * On return, *@pargv and *@pargc only cover the positional parameters,
+ * with (*@pargv)[0] still being the name of the program.
+ */
+int check_cli_params(int *pis_stream, int *pargc, char ***pargv);
 
 struct sockaddr *__get_addr(int is_xia, char *str1, char *str2, int *plen);
 
@@ -58,16 +126,30 @@ struct sockaddr *get_srv_addr(int is_xia, int argc, char * const argv[],
 void any_bind(int is_xia, int force, int s, const struct sockaddr *addr,
 	int addr_len);
 
+/* Hash the address @addr of @len bytes into a nonzero key. For IPv4 and
+ * IPv6, the port only counts if @with_port is true; other families hash
+ * all @len bytes.
+ */
+uint64_t addr_hash(const struct sockaddr *addr, socklen_t len,
+	int with_port);
+
 int read_command(char *buf, int len);
 
 void send_packet(int s, const char *buf, int n, const struct sockaddr *dst,
 	socklen_t dst_len);
 
+void stream_send(int s, const char *buf, int n);
+
 void recv_write(int s, const struct sockaddr *expected_src,
 	socklen_t exp_src_len, FILE *copy, int n_sent);
 
 void read_write(int s, FILE *copy, int n_sent);
 
+/* Release what the echoes of eopts.rx_zerocopy hold on their socket,
+ * before it is closed.
+ */
+void read_write_zc_end(void);
+
 /* Process File Function. */
 typedef void (*pff_mark_t)(int s);
 
@@ -80,6 +162,113 @@ void stream_process_file(int s, const char *orig_name, int chunk_size,
 xid_type_t get_xdp_type(void);
 xid_type_t get_srvc_type(void);
 
-void copy_data(int from, int to);
+struct hist;
+struct zc_socket;
+
+/* State of a copy from a descriptor to a socket. It keeps the data read
+ * but not yet written, so a copy can stop whenever either side would
+ * block, and resume once it no longer does.
+ * rpc_data() keeps the requests read in @buf instead, @written of them
+ * already parsed.
+ */
+struct copy_state {
+	int			from;
+	int			to;
+	char			*buf;
+	int			buf_size;
+	int			len;		/* Bytes in @buf. */
+	int			written;	/* Bytes of @buf written. */
+	unsigned long		start;		/* When @buf was read. */
+	unsigned long		copied;
+	unsigned long		received;	/* Dropped by source_data(). */
+	int			eof;
+	struct zc_socket	*zc;		/* NULL without zero-copy. */
+
+	/* Of rpc_data(). */
+	struct rpc_hdr		req;		/* Header being read. */
+	uint32_t		req_got;	/* Bytes of @req read. */
+	uint32_t		req_left;	/* Request bytes to drop. */
+	struct frame_hdr	resp;		/* Header of the response. */
+	uint32_t		resp_len;	/* 0 without a response. */
+	uint32_t		resp_sent;
+};
+
+/* Values of copy_data(). None is 0, which the helpers of the copies use
+ * for a write that completed.
+ */
+enum {
+	COPY_EOF = 1,	/* Done, end the copy with copy_end(). */
+	COPY_AGAIN,	/* Wait until @from is readable. */
+	COPY_BLOCKED,	/* Wait until @to is writable. */
+	COPY_ZC_WAIT,	/* Wait for zero-copy completions, see zc_send_nb(). */
+	COPY_YIELD,	/* The deficit ran out, more may be ready to copy. */
+};
+
+/* Start a copy from @from to @to. Copies with zero-copy, or that are
+ * @bulk, get buffers of POOL_MAX_SIZE, the others small ones.
+ */
+void copy_init(struct copy_state *c, int from, int to, int bulk);
+
+int copy_data(struct copy_state *c, struct hist *turnaround, long *deficit);
+
+/* Release the resources of @c, and return the number of bytes copied.
+ * Zero-copy sends in flight get up to @wait_ms to complete, see zc_end().
+ */
+unsigned long copy_end(struct copy_state *c, int wait_ms);
+
+/* What the server does with the data of the clients, see -m of eserv and
+ * ebench.
+ */
+enum echo_mode {
+	MODE_ECHO,	/* Send it back. */
+	MODE_DISCARD,	/* Drop it, as the discard service of RFC 863. */
+	MODE_SOURCE,	/* Drop it, and send the pattern instead, as the
+			 * character generator service of RFC 864.
+			 */
+	MODE_RPC,	/* Answer each request with a response of the size
+			 * it asks for, see struct rpc_hdr.
+			 */
+	MODE_BIDIR,	/* Drop it, and send the pattern at the same time,
+			 * streams only.
+			 */
+	MODE_TWAMP,	/* Reflect it as a TWAMP-Light reflector of
+			 * RFC 5357 does, datagrams only.
+			 */
+	MODES,
+};
+
+extern const char *mode_names[MODES];
+
+/* Return the mode named @name, or -1 if there is none. */
+int parse_mode(const char *name);
+
+/* The character generator pattern: lines of 72 printable characters,
+ * each starting one character further than the one before.
+ * Its length is PATTERN_SIZE, a whole number of the 95 lines after
+ * which the sequence repeats, so sending it again and again keeps the
+ * sequence, and it fits a datagram. It is never written after it is
+ * built, so any number of zero-copy sends may share it.
+ */
+#define PATTERN_LINE	74
+#define PATTERN_SIZE	(PATTERN_LINE * 95 * 9)
+const char *pattern(void);
+
+/* Read and drop what is ready on @c->from, counting it in @c->copied.
+ * Returns as copy_data() does, but never COPY_BLOCKED.
+ */
+int discard_data(struct copy_state *c, long *deficit);
+
+/* Drop what is ready on @c->from, counting it in @c->received, and write
+ * the pattern to @c->to, counting it in @c->copied, until the peer is
+ * gone. Returns as copy_data() does, but never COPY_AGAIN.
+ */
+int source_data(struct copy_state *c, long *deficit);
+
+/* Read the requests of eserv -m rpc from @c->from, and answer each one
+ * in turn on @c->to. Each sample of @turnaround runs from reading a whole
+ * request to sending its whole response. Returns as copy_data() does;
+ * a malformed request ends the copy.
+ */
+int rpc_data(struct copy_state *c, struct hist *turnaround, long *deficit);
 
 #endif /* _ECHO_UTILS_H */
@@ -0,0 +1,476 @@
+/*
+ * exdp.c
+ *
+ * This file implements the AF_XDP engine of the datagram echo server.
+ *
+ * All frames live in a UMEM shared with the kernel, and move through four
+ * rings: the fill ring gives free frames to the kernel, which returns them
+ * with datagrams through the RX ring. The engine reflects each datagram in
+ * its frame, and queues that same frame on the TX ring, so no datagram is
+ * ever copied in user space. Sent frames come back through the completion
+ * ring, and go to the fill ring again.
+ *
+ * The XDP program that redirects the datagrams to the socket is assembled
+ * here, and attached in generic (skb) mode, which every driver supports,
+ * veth included. In this mode, the kernel copies frames into the UMEM.
+ *
+ * This file does not include eutils.h, whose XIA headers name XDP, XIA's
+ * datagram principal, as well.
+ *
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include "ehist.h"
+#include "epacket.h"
+#include "exdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+/* Every frame fits in the fill ring, so returning a frame to the kernel
+ * never has to wait.
+ */
+#define NUM_FRAMES	4096
+#define FRAME_SIZE	2048
+#define FILL_SIZE	NUM_FRAMES
+#define COMP_SIZE	NUM_FRAMES
+#define RX_SIZE		2048
+#define TX_SIZE		2048
+#define BATCH		64
+
+/* Entries of the map from queues to sockets. */
+#define MAX_QUEUES	64
+
+struct xdp_ring {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	uint32_t	*flags;
+	void		*descs;
+	uint32_t	mask;
+	void		*map;
+	size_t		map_len;
+};
+
+struct xdp_sock {
+	int		fd;
+	char		*umem;
+	struct xdp_ring	fill;
+	struct xdp_ring	comp;
+	struct xdp_ring	rx;
+	struct xdp_ring	tx;
+};
+
+static int xdp_fd = -1;
+static _Atomic unsigned long reflected, passed_back, tx_full, kicks;
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Instructions, as the macros of the kernel's filter.h build them. */
+#define INSN(CODE, DST, SRC, OFF, IMM)					\
+	((struct bpf_insn) {.code = (CODE), .dst_reg = (DST),		\
+		.src_reg = (SRC), .off = (OFF), .imm = (IMM)})
+#define LDX_MEM(SIZE, DST, SRC, OFF)					\
+	INSN(BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, DST, SRC, OFF, 0)
+#define MOV64_REG(DST, SRC)						\
+	INSN(BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define MOV64_IMM(DST, IMM)						\
+	INSN(BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define ALU64_IMM(OP, DST, IMM)						\
+	INSN(BPF_ALU64 | BPF_OP(OP) | BPF_K, DST, 0, 0, IMM)
+#define JMP_REG(OP, DST, SRC, OFF)					\
+	INSN(BPF_JMP | BPF_OP(OP) | BPF_X, DST, SRC, OFF, 0)
+#define JMP_IMM(OP, DST, IMM, OFF)					\
+	INSN(BPF_JMP | BPF_OP(OP) | BPF_K, DST, 0, OFF, IMM)
+#define LD_MAP_FD(DST, FD)						\
+	INSN(BPF_LD | BPF_DW | BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD),	\
+	INSN(0, 0, 0, 0, 0)
+#define CALL(FUNC)	INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define EXIT()		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/* Offset of the jumps to the label pass, fixed when loading. */
+#define TO_PASS		0x7fff
+
+/**
+ * load_program(): Load the XDP program that redirects IPv4 UDP datagrams
+ * without options or fragmentation to @port to the socket of their queue
+ * in the XSKMAP @map_fd, and passes all other frames to the stack.
+ * Return the descriptor of the program, or -1.
+ */
+static int load_program(int map_fd, uint16_t port)
+{
+	struct bpf_insn insns[] = {
+		/* r2 = data, r3 = data_end */
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
+			offsetof(struct xdp_md, data)),
+		LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_1,
+			offsetof(struct xdp_md, data_end)),
+		/* Ethernet, IP, and UDP headers. */
+		MOV64_REG(BPF_REG_4, BPF_REG_2),
+		ALU64_IMM(BPF_ADD, BPF_REG_4, 14 + 20 + 8),
+		JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, TO_PASS),
+		/* Loads keep the network byte order of the fields. */
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 12),
+		JMP_IMM(BPF_JNE, BPF_REG_5, htons(0x0800), TO_PASS),
+		LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, 14),
+		JMP_IMM(BPF_JNE, BPF_REG_5, 0x45, TO_PASS),
+		LDX_MEM(BPF_B, BPF_REG_5, BPF_REG_2, 14 + 9),
+		JMP_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, TO_PASS),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 6),
+		ALU64_IMM(BPF_AND, BPF_REG_5, htons(0x3fff)),
+		JMP_IMM(BPF_JNE, BPF_REG_5, 0, TO_PASS),
+		LDX_MEM(BPF_H, BPF_REG_5, BPF_REG_2, 14 + 20 + 2),
+		JMP_IMM(BPF_JNE, BPF_REG_5, port, TO_PASS),
+		/* return bpf_redirect_map(map, rx_queue_index, XDP_PASS); */
+		LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_1,
+			offsetof(struct xdp_md, rx_queue_index)),
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		MOV64_IMM(BPF_REG_3, XDP_PASS),
+		CALL(BPF_FUNC_redirect_map),
+		EXIT(),
+		/* pass: */
+		MOV64_IMM(BPF_REG_0, XDP_PASS),
+		EXIT(),
+	};
+	int i, n = sizeof(insns) / sizeof(insns[0]);
+	static char log[64 * 1024];
+	union bpf_attr attr;
+	int fd;
+
+	for (i = 0; i < n; i++)
+		if (BPF_CLASS(insns[i].code) == BPF_JMP &&
+			insns[i].off == TO_PASS)
+			insns[i].off = n - 2 - i - 1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (unsigned long)insns;
+	attr.insn_cnt = n;
+	attr.license = (unsigned long)"GPL";
+	attr.log_buf = (unsigned long)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+		fprintf(stderr, "%s: BPF_PROG_LOAD errno=%i: %s\n%s",
+			__func__, errno, strerror(errno), log);
+	return fd;
+}
+
+/**
+ * attach(): Load the program, attach it to @ifindex in generic mode,
+ * and map queue 0 to @xsk. Return 0 on success. The program stays
+ * attached as long as the process lives.
+ */
+static int attach(int ifindex, uint16_t port, int xsk)
+{
+	union bpf_attr attr;
+	int map_fd, prog_fd, link_fd, queue = 0;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(int);
+	attr.value_size = sizeof(int);
+	attr.max_entries = MAX_QUEUES;
+	map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (map_fd < 0) {
+		fprintf(stderr, "%s: BPF_MAP_CREATE errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+
+	prog_fd = load_program(map_fd, port);
+	if (prog_fd < 0)
+		goto map;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (unsigned long)&queue;
+	attr.value = (unsigned long)&xsk;
+	assert(!sys_bpf(BPF_MAP_UPDATE_ELEM, &attr));
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (link_fd < 0) {
+		/* BPF links for XDP require Linux 5.9. */
+		fprintf(stderr, "%s: BPF_LINK_CREATE errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		assert(!close(prog_fd));
+		goto map;
+	}
+	/* The link holds the program, which holds the map. */
+	assert(!close(prog_fd));
+	assert(!close(map_fd));
+	return 0;
+
+map:
+	assert(!close(map_fd));
+	return -1;
+}
+
+static void map_ring(int fd, const struct xdp_ring_offset *off, off_t pgoff,
+	uint32_t size, size_t desc_size, struct xdp_ring *r)
+{
+	size_t len = off->desc + size * desc_size;
+	char *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+	assert(map != MAP_FAILED);
+	r->map = map;
+	r->map_len = len;
+	r->producer = (uint32_t *)(map + off->producer);
+	r->consumer = (uint32_t *)(map + off->consumer);
+	r->flags = (uint32_t *)(map + off->flags);
+	r->descs = map + off->desc;
+	r->mask = size - 1;
+}
+
+static void set_ring(int fd, int opt, uint32_t size)
+{
+	assert(!setsockopt(fd, SOL_XDP, opt, &size, sizeof(size)));
+}
+
+/**
+ * xsk_close(): Unmap what xsk_open() mapped, and close the socket.
+ */
+static void xsk_close(struct xdp_sock *x)
+{
+	struct xdp_ring *rings[] = {&x->fill, &x->comp, &x->rx, &x->tx};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+		if (rings[i]->map)
+			assert(!munmap(rings[i]->map, rings[i]->map_len));
+	if (x->umem)
+		assert(!munmap(x->umem, (size_t)NUM_FRAMES * FRAME_SIZE));
+	assert(!close(x->fd));
+}
+
+/**
+ * xsk_open(): Create the socket and its UMEM, and bind it to queue 0 of
+ * @ifindex. Return 0 on success, and undo everything on failure.
+ */
+static int xsk_open(struct xdp_sock *x, int ifindex)
+{
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t len = sizeof(off);
+	uint64_t *fill;
+	uint32_t i;
+
+	memset(x, 0, sizeof(*x));
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (x->fd < 0) {
+		fprintf(stderr, "%s: socket errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+
+	x->umem = mmap(NULL, (size_t)NUM_FRAMES * FRAME_SIZE,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
+		MAP_POPULATE, -1, 0);
+	assert(x->umem != MAP_FAILED);
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (unsigned long)x->umem;
+	reg.len = (uint64_t)NUM_FRAMES * FRAME_SIZE;
+	reg.chunk_size = FRAME_SIZE;
+	assert(!setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)));
+
+	set_ring(x->fd, XDP_UMEM_FILL_RING, FILL_SIZE);
+	set_ring(x->fd, XDP_UMEM_COMPLETION_RING, COMP_SIZE);
+	set_ring(x->fd, XDP_RX_RING, RX_SIZE);
+	set_ring(x->fd, XDP_TX_RING, TX_SIZE);
+	assert(!getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len));
+	map_ring(x->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, FILL_SIZE,
+		sizeof(uint64_t), &x->fill);
+	map_ring(x->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, COMP_SIZE,
+		sizeof(uint64_t), &x->comp);
+	map_ring(x->fd, &off.rx, XDP_PGOFF_RX_RING, RX_SIZE,
+		sizeof(struct xdp_desc), &x->rx);
+	map_ring(x->fd, &off.tx, XDP_PGOFF_TX_RING, TX_SIZE,
+		sizeof(struct xdp_desc), &x->tx);
+
+	/* All frames start with the kernel. */
+	fill = x->fill.descs;
+	for (i = 0; i < NUM_FRAMES; i++)
+		fill[i & x->fill.mask] = (uint64_t)i * FRAME_SIZE;
+	__atomic_store_n(x->fill.producer, NUM_FRAMES, __ATOMIC_RELEASE);
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = 0;
+	/* Generic mode always copies. */
+	sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+		fprintf(stderr, "%s: bind errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		xsk_close(x);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * recycle(): Move the frames the kernel has sent from the completion ring
+ * to the fill ring.
+ */
+static void recycle(struct xdp_sock *x)
+{
+	uint32_t prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+	uint32_t cons = *x->comp.consumer;
+	uint32_t fill = *x->fill.producer;
+	uint64_t *done = x->comp.descs, *free = x->fill.descs;
+
+	if (prod == cons)
+		return;
+	for (; cons != prod; cons++)
+		free[fill++ & x->fill.mask] = done[cons & x->comp.mask];
+	__atomic_store_n(x->comp.consumer, cons, __ATOMIC_RELEASE);
+	__atomic_store_n(x->fill.producer, fill, __ATOMIC_RELEASE);
+}
+
+static inline unsigned long mono_ns(void)
+{
+	struct timespec ts;
+
+	assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * echo_batch(): Reflect up to BATCH datagrams from the RX ring, and queue
+ * their frames on the TX ring. Frames that are not reflected go back to
+ * the fill ring. Return the number of datagrams received.
+ *
+ * The RX ring carries no arrival time, so each datagram echoed gets the
+ * time of the whole batch in @turnaround, from when it was taken off the
+ * RX ring until the echoes were handed to the kernel. That bounds the
+ * time of each one in user space.
+ */
+static uint32_t echo_batch(struct xdp_sock *x, uint16_t port,
+	struct hist *turnaround, unsigned long *bytes)
+{
+	uint32_t rx_prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	uint32_t rx_cons = *x->rx.consumer;
+	uint32_t tx_prod = *x->tx.producer;
+	uint32_t tx_room = TX_SIZE - (tx_prod -
+		__atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE));
+	uint32_t fill = *x->fill.producer;
+	struct xdp_desc *rx = x->rx.descs, *tx = x->tx.descs;
+	uint64_t *free = x->fill.descs;
+	uint32_t i, n = rx_prod - rx_cons, sent = 0;
+	unsigned long start = mono_ns(), batch_ns;
+
+	if (n > BATCH)
+		n = BATCH;
+	for (i = 0; i < n; i++) {
+		struct xdp_desc d = rx[(rx_cons + i) & x->rx.mask];
+		/* The kernel may not have computed the checksum, and the
+		 * copy into the UMEM loses that information.
+		 */
+		int len = udp_reflect(x->umem + d.addr, d.len, port, 1);
+
+		if (len >= 0 && tx_room) {
+			tx[tx_prod++ & x->tx.mask] = d;
+			tx_room--;
+			sent++;
+			*bytes += len;
+			continue;
+		}
+		atomic_fetch_add_explicit(len < 0 ? &passed_back : &tx_full,
+			1, memory_order_relaxed);
+		free[fill++ & x->fill.mask] = d.addr;
+	}
+	__atomic_store_n(x->rx.consumer, rx_cons + n, __ATOMIC_RELEASE);
+	__atomic_store_n(x->fill.producer, fill, __ATOMIC_RELEASE);
+	__atomic_store_n(x->tx.producer, tx_prod, __ATOMIC_RELEASE);
+
+	if (sent && (__atomic_load_n(x->tx.flags, __ATOMIC_ACQUIRE) &
+		XDP_RING_NEED_WAKEUP)) {
+		if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0)
+			assert(errno == EAGAIN || errno == EBUSY ||
+				errno == ENOBUFS || errno == ENETDOWN);
+		atomic_fetch_add_explicit(&kicks, 1, memory_order_relaxed);
+	}
+
+	batch_ns = mono_ns() - start;
+	for (i = 0; i < sent; i++)
+		hist_add(turnaround, batch_ns);
+	atomic_fetch_add_explicit(&reflected, sent, memory_order_relaxed);
+	return n;
+}
+
+int xdp_datagram_loop(const char *ifname, uint16_t port,
+	struct hist *turnaround, unsigned long *bytes)
+{
+	static struct xdp_sock x;
+	int ifindex = if_nametoindex(ifname);
+
+	if (!ifindex) {
+		fprintf(stderr, "%s: no interface %s\n", __func__, ifname);
+		return -1;
+	}
+	if (xsk_open(&x, ifindex))
+		return -1;
+	if (attach(ifindex, port, x.fd)) {
+		xsk_close(&x);
+		return -1;
+	}
+	xdp_fd = x.fd;
+
+	while (1) {
+		recycle(&x);
+		if (!echo_batch(&x, port, turnaround, bytes)) {
+			struct pollfd pfd = {.fd = x.fd, .events = POLLIN};
+
+			assert(poll(&pfd, 1, -1) >= 0 || errno == EINTR);
+		}
+	}
+}
+
+void xdp_report(FILE *f, void *arg)
+{
+	struct xdp_statistics st;
+	socklen_t len = sizeof(st);
+
+	(void)arg;
+	memset(&st, 0, sizeof(st));
+	if (xdp_fd >= 0)
+		getsockopt(xdp_fd, SOL_XDP, XDP_STATISTICS, &st, &len);
+	fprintf(f, "AF_XDP: %lu datagrams reflected, %lu frames not "
+		"reflected, %lu dropped for a full TX ring, %lu sends; "
+		"kernel: %llu dropped, %llu RX ring full, %llu fill ring "
+		"empty\n", atomic_load(&reflected), atomic_load(&passed_back),
+		atomic_load(&tx_full), atomic_load(&kicks),
+		(unsigned long long)st.rx_dropped,
+		(unsigned long long)st.rx_ring_full,
+		(unsigned long long)st.rx_fill_ring_empty_descs);
+}
@@ -0,0 +1,32 @@
+/*
+ * exdp.h
+ *
+ * A header file for the AF_XDP engine of the datagram echo server.
+ *
+ */
+
+#ifndef _ECHO_XDP_H
+#define _ECHO_XDP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct hist;
+
+/* Echo the datagrams to @port, in network byte order, that arrive at
+ * queue 0 of interface @ifname through an AF_XDP socket. An XDP program
+ * attached in generic (skb) mode redirects those datagrams to the socket,
+ * and lets everything else go on to the stack. The frames are reflected
+ * in place in the UMEM and sent from there.
+ * The bytes echoed go to *@bytes as in the classic loop, but since AF_XDP
+ * gives no arrival time, @turnaround gets for each datagram the time its
+ * batch took, from the RX ring to the kick of the TX ring.
+ * This only returns if AF_XDP cannot be set up, and then returns -1.
+ */
+int xdp_datagram_loop(const char *ifname, uint16_t port,
+	struct hist *turnaround, unsigned long *bytes);
+
+/* Print the counters of the rings. */
+void xdp_report(FILE *f, void *arg);
+
+#endif /* _ECHO_XDP_H */
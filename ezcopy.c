@@ -0,0 +1,383 @@
+/*
+ * ezcopy.c
+ *
+ * This file implements the zero-copy transmit path (MSG_ZEROCOPY) of the
+ * echo server and clients, and the zero-copy receive path
+ * (TCP_ZEROCOPY_RECEIVE) of the stream clients.
+ *
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+#include "eutils.h"
+#include "epool.h"
+#include "ezcopy.h"
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY		5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED	1
+#endif
+
+static _Atomic unsigned long small_sends;
+static _Atomic unsigned long zc_sends;
+static _Atomic unsigned long zc_completed;
+static _Atomic unsigned long zc_copied;
+static _Atomic unsigned long zc_lost;
+
+int zc_init(struct zc_socket *z, int s)
+{
+	int one = 1;
+
+	memset(z, 0, sizeof(*z));
+	z->fd = s;
+	if (setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+		fprintf(stderr, "%s: setsockopt errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * release(): Give the buffers of the oldest completed sends back to
+ * the pool.
+ */
+static void release(struct zc_socket *z)
+{
+	while (z->tail != z->next_id) {
+		unsigned int i = z->tail & (ZC_MAX_PENDING - 1);
+
+		if (!z->pending[i].done)
+			break;
+		if (z->pending[i].buf)
+			pool_put(z->pending[i].buf);
+		z->pending[i].buf = NULL;
+		z->pending[i].done = 0;
+		z->tail++;
+	}
+}
+
+/**
+ * complete(): Mark the sends from @lo to @hi, both included, as complete.
+ */
+static void complete(struct zc_socket *z, uint32_t lo, uint32_t hi,
+	int copied)
+{
+	uint32_t id;
+
+	for (id = lo; id != hi + 1; id++) {
+		/* Ignore ids that are not pending. */
+		if (id - z->tail >= (uint32_t)zc_in_flight(z))
+			continue;
+		z->pending[id & (ZC_MAX_PENDING - 1)].done = 1;
+	}
+	atomic_fetch_add_explicit(&zc_completed, hi - lo + 1,
+		memory_order_relaxed);
+	if (copied)
+		atomic_fetch_add_explicit(&zc_copied, hi - lo + 1,
+			memory_order_relaxed);
+	release(z);
+}
+
+void zc_reap(struct zc_socket *z, int wait)
+{
+	while (zc_in_flight(z)) {
+		char control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(z->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			struct pollfd pfd = {.fd = z->fd, .events = 0};
+
+			assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			if (!wait)
+				return;
+			/* POLLERR is always reported. */
+			assert(poll(&pfd, 1, -1) >= 0);
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr;
+
+			if (!((cm->cmsg_level == SOL_IP &&
+				cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 &&
+				cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+				serr->ee_errno)
+				continue;
+			complete(z, serr->ee_info, serr->ee_data,
+				serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+			wait = 0;
+		}
+	}
+}
+
+void zc_flush(struct zc_socket *z)
+{
+	while (zc_in_flight(z))
+		zc_reap(z, 1);
+}
+
+/**
+ * send_once(): Issue a single MSG_ZEROCOPY send, making room for its
+ * completion first. Return what sendto() returns.
+ */
+static ssize_t send_once(struct zc_socket *z, const char *buf, size_t len,
+	const struct sockaddr *dst, socklen_t dst_len)
+{
+	ssize_t rc;
+
+	while (1) {
+		zc_reap(z, zc_in_flight(z) >= ZC_MAX_PENDING);
+		rc = sendto(z->fd, buf, len, MSG_ZEROCOPY, dst, dst_len);
+		/* ENOBUFS: too many notifications pending. */
+		if (rc >= 0 || errno != ENOBUFS || !zc_in_flight(z))
+			break;
+		zc_reap(z, 1);
+	}
+
+	if (rc >= 0) {
+		/* Any send that returns a length gets an id. */
+		z->next_id++;
+		atomic_fetch_add_explicit(&zc_sends, 1, memory_order_relaxed);
+	}
+	return rc;
+}
+
+ssize_t zc_send(struct zc_socket *z, void *buf, size_t len,
+	const struct sockaddr *dst, socklen_t dst_len)
+{
+	size_t sent = 0;
+	ssize_t rc;
+
+	if (len < ZC_THRESHOLD) {
+		rc = sendto(z->fd, buf, len, 0, dst, dst_len);
+		atomic_fetch_add_explicit(&small_sends, 1,
+			memory_order_relaxed);
+		pool_put(buf);
+		return rc;
+	}
+
+	while (sent < len) {
+		rc = send_once(z, (char *)buf + sent, len - sent, dst, dst_len);
+		if (rc < 0)
+			break;
+		sent += rc;
+	}
+
+	if (sent) {
+		/* The last id that covers @buf releases it. */
+		z->pending[(z->next_id - 1) & (ZC_MAX_PENDING - 1)].buf = buf;
+		zc_reap(z, 0);
+		return sent;
+	}
+	pool_put(buf);
+	return -1;
+}
+
+ssize_t zc_send_nb(struct zc_socket *z, const void *buf, size_t len)
+{
+	ssize_t rc;
+
+	if (len < ZC_THRESHOLD) {
+		rc = send(z->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc >= 0)
+			atomic_fetch_add_explicit(&small_sends, 1,
+				memory_order_relaxed);
+		return rc;
+	}
+
+	zc_reap(z, 0);
+	if (zc_in_flight(z) >= ZC_MAX_PENDING) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	rc = send(z->fd, buf, len, MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (rc >= 0) {
+		z->next_id++;
+		atomic_fetch_add_explicit(&zc_sends, 1, memory_order_relaxed);
+	}
+	return rc;
+}
+
+void zc_release(struct zc_socket *z, void *buf)
+{
+	/* If no send since the last release used MSG_ZEROCOPY, or all
+	 * of them already completed, the kernel holds no reference to @buf.
+	 */
+	if (z->next_id == z->released || !zc_in_flight(z)) {
+		pool_put(buf);
+	} else {
+		/* The last id that covers @buf releases it. */
+		z->pending[(z->next_id - 1) & (ZC_MAX_PENDING - 1)].buf = buf;
+	}
+	z->released = z->next_id;
+	zc_reap(z, 0);
+}
+
+void zc_end(struct zc_socket *z, int wait_ms)
+{
+	unsigned long end = now_ns() + wait_ms * 1000000UL;
+	uint32_t id;
+
+	zc_reap(z, 0);
+	while (zc_in_flight(z)) {
+		struct pollfd pfd = {.fd = z->fd, .events = 0};
+		unsigned long now = now_ns();
+
+		if (now >= end)
+			break;
+		/* POLLERR is always reported. */
+		if (poll(&pfd, 1, (end - now) / 1000000 + 1) > 0)
+			zc_reap(z, 0);
+	}
+
+	/* The kernel may still read what is left, so it is not reused. */
+	for (id = z->tail; id != z->next_id; id++)
+		if (z->pending[id & (ZC_MAX_PENDING - 1)].buf)
+			atomic_fetch_add_explicit(&zc_lost, 1,
+				memory_order_relaxed);
+}
+
+void zc_report(FILE *f, void *arg)
+{
+	unsigned long zc = atomic_load(&zc_sends);
+	unsigned long completed = atomic_load(&zc_completed);
+	unsigned long copied = atomic_load(&zc_copied);
+
+	UNUSED(arg);
+	fprintf(f, "zerocopy: %lu sends below %i bytes, %lu MSG_ZEROCOPY "
+		"sends: %lu zero-copy, %lu copied by the kernel, "
+		"%lu pending, %lu buffers lost to closed sockets\n",
+		atomic_load(&small_sends), ZC_THRESHOLD, zc, completed - copied,
+		copied, zc - completed, atomic_load(&zc_lost));
+}
+
+/* Must be a multiple of the page size. */
+#define ZC_RX_WINDOW (512 * 1024)
+
+static _Atomic unsigned long rx_mapped;
+static _Atomic unsigned long rx_copied;
+
+int zc_rx_init(struct zc_rx *r, int s)
+{
+	zc_rx_end(r);
+	r->fd = s;
+	r->window_len = ZC_RX_WINDOW;
+	r->window = mmap(NULL, r->window_len, PROT_READ, MAP_SHARED, s, 0);
+	if (r->window == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap errno=%i: %s\n",
+			__func__, errno, strerror(errno));
+		r->window = NULL;
+		r->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void zc_rx_end(struct zc_rx *r)
+{
+	if (r->window)
+		assert(!munmap(r->window, r->window_len));
+	r->window = NULL;
+	r->fd = -1;
+}
+
+/**
+ * rx_copy(): Receive up to @len bytes the classic way, and write them to
+ * @copy. Return what recv() returns.
+ */
+static ssize_t rx_copy(struct zc_rx *r, FILE *copy, size_t len)
+{
+	char *buf;
+	ssize_t n;
+
+	if (len > POOL_MAX_SIZE)
+		len = POOL_MAX_SIZE;
+	buf = pool_get(len);
+	n = recv(r->fd, buf, len, 0);
+	if (n > 0) {
+		fwrite(buf, 1, n, copy);
+		atomic_fetch_add_explicit(&rx_copied, n, memory_order_relaxed);
+	}
+	pool_put(buf);
+	return n;
+}
+
+size_t zc_rx_read_write(struct zc_rx *r, FILE *copy, size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE), done = 0;
+	int waited = 0;
+
+	while (done < len) {
+		struct tcp_zerocopy_receive zc;
+		socklen_t zc_len = sizeof(zc);
+		size_t want = len - done;
+		ssize_t n;
+
+		memset(&zc, 0, sizeof(zc));
+		zc.address = (__u64)(unsigned long)r->window;
+		zc.length = want < r->window_len ? want : r->window_len;
+		zc.length &= ~(page - 1);
+
+		if (zc.length && !getsockopt(r->fd, IPPROTO_TCP,
+			TCP_ZEROCOPY_RECEIVE, &zc, &zc_len)) {
+			if (zc.length) {
+				fwrite(r->window, 1, zc.length, copy);
+				atomic_fetch_add_explicit(&rx_mapped,
+					zc.length, memory_order_relaxed);
+				done += zc.length;
+				waited = 0;
+				continue;
+			}
+			if (zc.recv_skip_hint) {
+				/* Bytes that cannot be mapped. */
+				want = zc.recv_skip_hint < want
+					? zc.recv_skip_hint : want;
+			} else if (!waited) {
+				/* Nothing queued yet. */
+				struct pollfd pfd = {.fd = r->fd,
+					.events = POLLIN};
+				assert(poll(&pfd, 1, -1) >= 0);
+				waited = 1;
+				continue;
+			}
+		}
+
+		/* Sub-page tail, no zero-copy support, or end of stream. */
+		n = rx_copy(r, copy, want);
+		if (n <= 0)
+			break;
+		done += n;
+		waited = 0;
+	}
+	return done;
+}
+
+void zc_rx_report(FILE *f, void *arg)
+{
+	unsigned long mapped = atomic_load(&rx_mapped);
+	unsigned long copied = atomic_load(&rx_copied);
+
+	UNUSED(arg);
+	fprintf(f, "zerocopy receive: %lu bytes mapped, %lu bytes copied, "
+		"%.1f%% zero-copy\n", mapped, copied,
+		mapped + copied ? 100.0 * mapped / (mapped + copied) : 0.0);
+}
@@ -0,0 +1,117 @@
+/*
+ * ezcopy.h
+ *
+ * A header file for the zero-copy I/O of the echo server and clients.
+ *
+ */
+
+#ifndef _ECHO_ZCOPY_H
+#define _ECHO_ZCOPY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* Sends below this size are cheaper to copy than to pin and notify. */
+#define ZC_THRESHOLD	(10 * 1024)
+
+/* Must be a power of 2. */
+#define ZC_MAX_PENDING	256
+
+/* Transmit state of a socket with SO_ZEROCOPY. Every MSG_ZEROCOPY send
+ * gets the next id, and the kernel notifies completions of ranges of ids
+ * through the error queue of the socket. A buffer goes back to the pool
+ * once all sends that cover it complete.
+ */
+struct zc_socket {
+	int		fd;
+	uint32_t	next_id;	/* Id of the next send. */
+	uint32_t	tail;		/* Oldest send not released. */
+	uint32_t	released;	/* Value of @next_id at the last
+					 * zc_release().
+					 */
+	struct {
+		void	*buf;		/* Set on the last send of a buffer. */
+		int	done;
+	} pending[ZC_MAX_PENDING];
+};
+
+/* Enable SO_ZEROCOPY on @s. Return 0 on success. */
+int zc_init(struct zc_socket *z, int s);
+
+/* Send @len bytes of @buf, which must come from the pool, to @dst, or to
+ * the peer of a connected socket if @dst is NULL. Stream sockets send all
+ * @len bytes. This takes ownership of @buf, which goes back to the pool
+ * when the kernel no longer needs it. Return the number of bytes sent,
+ * or -1 on error, in which case @buf still goes back to the pool.
+ */
+ssize_t zc_send(struct zc_socket *z, void *buf, size_t len,
+	const struct sockaddr *dst, socklen_t dst_len);
+
+/* Send up to @len bytes of @buf to the peer of the connected socket
+ * without blocking. Unlike zc_send(), this does not take ownership of
+ * @buf, so a buffer can take several calls to go out; hand it to
+ * zc_release() once it has. Return what send() returns, or -1 with errno
+ * set to ENOBUFS when the completions of earlier sends must be reaped
+ * first, which the error queue signals with POLLERR.
+ */
+ssize_t zc_send_nb(struct zc_socket *z, const void *buf, size_t len);
+
+/* Give @buf, fully sent with zc_send_nb(), back to the pool once the
+ * kernel no longer needs it.
+ */
+void zc_release(struct zc_socket *z, void *buf);
+
+/* Number of sends whose completion is pending. */
+static inline int zc_in_flight(const struct zc_socket *z)
+{
+	return z->next_id - z->tail;
+}
+
+/* Process the completions in the error queue of the socket. If @wait is
+ * true, block until at least one pending send completes.
+ */
+void zc_reap(struct zc_socket *z, int wait);
+
+/* Wait for all pending sends to complete. */
+void zc_flush(struct zc_socket *z);
+
+/* Before the socket is closed, wait up to @wait_ms for pending sends to
+ * complete, and give their buffers back to the pool. The buffers of the
+ * sends still pending then are never reused, since the kernel may still
+ * read them, and are counted as lost in zc_report().
+ */
+void zc_end(struct zc_socket *z, int wait_ms);
+
+/* Print how many sends were zero-copy, and how many the kernel copied. */
+void zc_report(FILE *f, void *arg);
+
+/* Receive state of a TCP socket with TCP_ZEROCOPY_RECEIVE. Received pages
+ * are mapped in a window of the address space of the process instead of
+ * being copied.
+ */
+struct zc_rx {
+	int	fd;
+	char	*window;
+	size_t	window_len;
+};
+
+/* Map the receive window of @s, unmapping the window of an earlier socket
+ * first. Return 0 on success.
+ */
+int zc_rx_init(struct zc_rx *r, int s);
+
+/* Unmap the receive window, if any. Call it before closing its socket. */
+void zc_rx_end(struct zc_rx *r);
+
+/* Receive exactly @len bytes, and write them to @copy. Whole pages are
+ * mapped, the rest, such as sub-page tails, is copied.
+ * Return the number of bytes received, less than @len if the connection
+ * is closed or fails.
+ */
+size_t zc_rx_read_write(struct zc_rx *r, FILE *copy, size_t len);
+
+/* Print the fraction of bytes received zero-copy. */
+void zc_rx_report(FILE *f, void *arg);
+
+#endif /* _ECHO_ZCOPY_H */
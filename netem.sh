@@ -0,0 +1,145 @@
+#!/bin/bash
+#
+# Run the benchmarks of bench.sh and an ecli file transfer across a veth
+# pair joining two network namespaces, once per impairment profile applied
+# with tc netem, and print all results as a JSON array.
+# It must run as root, and netem must be available (sch_netem).
+#
+# Environment variables:
+#	PROFILES	space-separated list of profiles, each profile is
+#			name:delay:jitter:loss:rate, where delay and jitter
+#			are netem times (e.g. 10ms), loss is a percentage,
+#			and rate is a netem rate (e.g. 100mbit). An empty
+#			field leaves that impairment out. The impairments
+#			apply to each direction, so the RTT doubles the delay.
+#	FILE		file that ecli sends in datagram and stream modes
+#			(default: the ecli binary)
+#	NETEM_OUT	file to which the results are written
+#			(default: netem.json)
+# The settings of bench.sh (DURATION, SIZES, FLOWS, ...) apply as well.
+
+PROFILES=${PROFILES:-"lan:100us::: wan:20ms:2ms:: lossy:5ms:1ms:1: \
+slow:10ms::0.1:10mbit"}
+NETEM_OUT=${NETEM_OUT:-netem.json}
+
+NS_SRV=eserv_ns
+NS_CLI=ecli_ns
+VETH_SRV=veth_srv
+VETH_CLI=veth_cli
+ADDR_SRV=10.77.0.1
+ADDR_CLI=10.77.0.2
+PORT=9800
+
+cd "$(dirname "$0")"
+FILE=${FILE:-$PWD/ecli}
+
+if [ "$(id -u)" != 0 ]
+then
+	echo "`basename $0` must run as root" >&2
+	exit 1
+fi
+
+teardown() {
+	ip netns del $NS_SRV 2> /dev/null
+	ip netns del $NS_CLI 2> /dev/null
+	rm -f "$FILE"_echo
+}
+
+setup() {
+	teardown
+	ip netns add $NS_SRV || exit 1
+	ip netns add $NS_CLI || exit 1
+	ip link add $VETH_SRV netns $NS_SRV type veth \
+		peer name $VETH_CLI netns $NS_CLI || exit 1
+	ip -n $NS_SRV addr add $ADDR_SRV/24 dev $VETH_SRV
+	ip -n $NS_CLI addr add $ADDR_CLI/24 dev $VETH_CLI
+	ip -n $NS_SRV link set lo up
+	ip -n $NS_CLI link set lo up
+	ip -n $NS_SRV link set $VETH_SRV up
+	ip -n $NS_CLI link set $VETH_CLI up
+}
+
+# apply_profile delay jitter loss rate
+apply_profile() {
+	local args=""
+
+	if [ -n "$1" ]
+	then
+		args="delay $1"
+		[ -n "$2" ] && args="$args $2 distribution normal"
+	fi
+	[ -n "$3" ] && args="$args loss $3%"
+	[ -n "$4" ] && args="$args rate $4"
+
+	for pair in $NS_SRV:$VETH_SRV $NS_CLI:$VETH_CLI
+	do
+		local ns=${pair%%:*} dev=${pair##*:}
+		if [ -z "$args" ]
+		then
+			tc -n $ns qdisc del dev $dev root 2> /dev/null
+		elif ! tc -n $ns qdisc replace dev $dev root netem $args
+		then
+			echo "Cannot apply netem $args, is sch_netem" \
+				"available?" >&2
+			exit 1
+		fi
+	done
+}
+
+# ecli_file mode port: send $FILE through ecli to an eserv on port and
+# report how long it took, how many receive timeouts ecli hit, and whether
+# the copy matches. It runs in a command substitution, so the caller picks
+# the port.
+ecli_file() {
+	local mode=$1 port=$2 start end seconds dots same
+
+	ip netns exec $NS_SRV ./eserv $mode ip $port > /dev/null 2>&1 &
+	local pid=$!
+	sleep 0.2
+
+	rm -f "$FILE"_echo
+	start=$(date +%s.%N)
+	dots=$(echo "-f $FILE" | ip netns exec $NS_CLI ./ecli $mode ip \
+		$ADDR_SRV $port 2>&1 > /dev/null | tr -cd . | wc -c)
+	end=$(date +%s.%N)
+	cmp -s "$FILE" "$FILE"_echo && same=true || same=false
+
+	kill -INT $pid 2> /dev/null
+	wait $pid 2> /dev/null
+	seconds=$(awk "BEGIN {print $end - $start}")
+	echo "{\"mode\": \"$mode\", \"seconds\": $seconds," \
+		"\"timeouts\": $dots, \"intact\": $same}"
+}
+
+trap teardown EXIT
+setup
+
+{
+	echo "["
+	first=1
+	for profile in $PROFILES
+	do
+		IFS=: read name delay jitter loss rate <<< "$profile"
+		echo "Profile $name: delay=$delay jitter=$jitter loss=$loss" \
+			"rate=$rate" >&2
+		apply_profile "$delay" "$jitter" "$loss" "$rate"
+
+		[ $first = 1 ] || echo ","
+		first=0
+		echo "{\"profile\": {\"name\": \"$name\"," \
+			"\"delay\": \"$delay\", \"jitter\": \"$jitter\"," \
+			"\"loss_pct\": \"$loss\", \"rate\": \"$rate\"},"
+		PORT=$((PORT + 2))
+		echo "\"ecli\": [$(ecli_file datagram $((PORT - 1)))," \
+			"$(ecli_file stream $PORT)],"
+		echo "\"bench\":"
+		SERV_PREFIX="ip netns exec $NS_SRV" \
+		CLI_PREFIX="ip netns exec $NS_CLI" \
+		SERV_ADDR=$ADDR_SRV \
+			./bench.sh
+		echo "}"
+	done
+	echo "]"
+} > "$NETEM_OUT"
+
+echo "Results written to $NETEM_OUT" >&2